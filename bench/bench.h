@@ -0,0 +1,54 @@
+#ifndef INCLUDE_BENCH_BENCH_H_
+#define INCLUDE_BENCH_BENCH_H_
+
+#include <string.h>
+#include <time.h>
+
+/**
+ * Returns the time in microseconds from some fixed point.
+ */
+static inline double bench_now_us(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+/**
+ * Returns the next number of a fixed sequence, for the generated files to be
+ * the same on every run.
+ */
+static inline unsigned bench_random(unsigned *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 16;
+}
+
+/**
+ * Fills line with pieces of source picked from the n given ones until it is
+ * at least len characters long, or as long as fits in cap. Returns its
+ * length.
+ */
+static inline int bench_source_line(char *line, int cap, int len,
+                                    char const *const *pieces, int n,
+                                    unsigned *seed)
+{
+    int size = 0;
+
+    while (size < len) {
+        char const *piece = pieces[bench_random(seed) % n];
+        int piece_len = strlen(piece);
+
+        if (size + piece_len > cap) {
+            break;
+        }
+
+        memcpy(&line[size], piece, piece_len);
+        size += piece_len;
+    }
+
+    return size;
+}
+
+#endif // INCLUDE_BENCH_BENCH_H_
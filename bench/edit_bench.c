@@ -0,0 +1,46 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "editor.h"
+
+// Enter and Backspace pressed at each size of the file
+#define EDIT_BENCH_REPS 1000
+
+/**
+ * Times Enter followed by Backspace near the top of a file growing from 10K
+ * lines to 10M, or to the number of lines given. Splitting and joining a row
+ * should take as long whatever the number of rows below it.
+ */
+int main(int argc, char *argv[])
+{
+    long max_lines = argc > 1 ? atol(argv[1]) : 10000000;
+    char line[] = "2024-01-01 12:00:00 INFO request handled in 12ms id=abcdef";
+    long lines;
+    int i;
+
+    printf("%10s %16s\n", "lines", "us per key");
+
+    for (lines = 10000; lines <= max_lines; lines *= 10) {
+        while (ec.num_trows < lines) {
+            insert_text_row(ec.num_trows, line, sizeof(line) - 1);
+        }
+
+        ec.cy = 10;
+        ec.cx = 5;
+
+        double start = bench_now_us();
+
+        for (i = 0; i < EDIT_BENCH_REPS; i++) {
+            insert_new_line();
+            delete_char();
+        }
+
+        printf("%10ld %16.2f\n", lines,
+               (bench_now_us() - start) / (2 * EDIT_BENCH_REPS));
+    }
+
+    return EXIT_SUCCESS;
+}
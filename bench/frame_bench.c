@@ -0,0 +1,86 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "editor.h"
+#include "highlight.h"
+#include "screen.h"
+
+#define FRAME_BENCH_LINES 3000
+#define FRAME_BENCH_FRAMES 2000
+
+static char const *const c_pieces[] = {
+    "\t",         "    ",         "int ",        "char *",    "return ",
+    "if (",       ") {",          "} else {",    "while (",   "for (;;) ",
+    "count",      "name",         "buf->len",    " = ",       " == ",
+    " + ",        ", ",           "; ",          "42",        "0x1f",
+    "3.14",       "\"a string\"", "'c'",         "/* note */", "sizeof(x)",
+    "static ",    "unsigned ",    "struct row ", "NULL",      "(void)",
+};
+
+/**
+ * Times the frames of a C file of FRAME_BENCH_LINES lines of 100 to 300
+ * columns shown on a 300x100 terminal, drawn in full after a jump and after
+ * only the cursor moved. The frames go to /dev/null.
+ */
+int main(void)
+{
+    int out = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    char line[512];
+    unsigned seed = 1;
+    int i;
+
+    if (out == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1) {
+        perror("Failed to write to /dev/null");
+        return EXIT_FAILURE;
+    }
+
+    ec.rows = 98;
+    ec.cols = 300;
+    ec.filename = "frame_bench.c";
+    select_syntax_highlight();
+
+    for (i = 0; i < FRAME_BENCH_LINES; i++) {
+        int len = bench_source_line(line, sizeof(line),
+                                    100 + bench_random(&seed) % 201, c_pieces,
+                                    sizeof(c_pieces) / sizeof(*c_pieces),
+                                    &seed);
+        insert_text_row(ec.num_trows, line, len);
+    }
+
+    refresh_screen();
+
+    long bytes = screen_get_stats().bytes;
+    double start = bench_now_us();
+
+    for (i = 0; i < FRAME_BENCH_FRAMES; i++) {
+        screen_invalidate();
+        ec.cy = ec.row_offset = i * 7 % (FRAME_BENCH_LINES - ec.rows);
+        refresh_screen();
+    }
+
+    double full = (bench_now_us() - start) / FRAME_BENCH_FRAMES;
+    long full_bytes = screen_get_stats().bytes - bytes;
+
+    start = bench_now_us();
+
+    for (i = 0; i < FRAME_BENCH_FRAMES; i++) {
+        ec.cy = ec.row_offset + i % 50;
+        refresh_screen();
+    }
+
+    double cursor = (bench_now_us() - start) / FRAME_BENCH_FRAMES;
+    long cursor_bytes = screen_get_stats().bytes - bytes - full_bytes;
+
+    dprintf(out, "300x100 full redraw: %8.1f us/frame, %6ld bytes/frame\n",
+            full, full_bytes / FRAME_BENCH_FRAMES);
+    dprintf(out, "300x100 cursor move: %8.1f us/frame, %6ld bytes/frame\n",
+            cursor, cursor_bytes / FRAME_BENCH_FRAMES);
+
+    return EXIT_SUCCESS;
+}
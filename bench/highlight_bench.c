@@ -0,0 +1,165 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "editor.h"
+#include "highlight.h"
+
+// lines of the files generated when none are given
+#define HIGHLIGHT_BENCH_LINES 200000
+#define HIGHLIGHT_BENCH_PASSES 7
+
+static char const *const c_pieces[] = {
+    "\t",         "    ",          "int ",         "char *",     "return ",
+    "if (",       ") {",           "} else {",     "while (",    "for (;;) ",
+    "count",      "name",          "buf->len",     " = ",        " == ",
+    " + ",        ", ",            "; ",           "42",         "0x1f",
+    "3.14",       "\"a string\"",  "'c'",          "/* note */", "sizeof(x)",
+    "static ",    "unsigned ",     "struct row ",  "NULL",       "(void)",
+};
+
+static char const *const go_pieces[] = {
+    "\t",         "func ",         "package ",     "import ",    "return ",
+    "if ",        " {",            "} else {",     "for ",       "range ",
+    "count",      "name",          "buf.Len()",    " := ",       " == ",
+    " + ",        ", ",            "err",          "42",         "0x1f",
+    "3.14",       "\"a string\"",  "`raw`",        "/* note */", "len(x)",
+    "var ",       "chan ",         "struct{} ",    "nil",        "go ",
+};
+
+/**
+ * Fills the document with lines of the given pieces of source, generated
+ * from a fixed seed.
+ */
+static void generate(char const *const *pieces, int n)
+{
+    char line[256];
+    unsigned seed = 1;
+    int i;
+
+    for (i = 0; i < HIGHLIGHT_BENCH_LINES; i++) {
+        int len = bench_source_line(line, sizeof(line),
+                                    bench_random(&seed) % 120, pieces, n,
+                                    &seed);
+        insert_text_row(ec.num_trows, line, len);
+    }
+}
+
+/**
+ * Fills the document with the lines of the file at path.
+ */
+static int load(char const *path)
+{
+    FILE *f = fopen(path, "r");
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+
+    while ((len = getline(&line, &cap, f)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') {
+            len--;
+        }
+        insert_text_row(ec.num_trows, line, len);
+    }
+
+    free(line);
+    fclose(f);
+    return 0;
+}
+
+/**
+ * Highlights every row of the document HIGHLIGHT_BENCH_PASSES times and
+ * prints the fastest pass, along with a checksum of the highlight for runs
+ * to be compared.
+ */
+static void run(char const *name)
+{
+    unsigned long sum = 0;
+    double best = 0;
+    int pass;
+    int i;
+
+    // every row gets a render and a highlight to update
+    for (i = 0; i < ec.num_trows; i++) {
+        render_row(i);
+    }
+
+    for (pass = 0; pass < HIGHLIGHT_BENCH_PASSES; pass++) {
+        int open_comment = 0;
+        double start = bench_now_us();
+
+        for (i = 0; i < ec.num_trows; i++) {
+            open_comment = update_syntax(doc_get(&ec.doc, i), open_comment);
+        }
+
+        double took = bench_now_us() - start;
+
+        if (pass == 0 || took < best) {
+            best = took;
+        }
+    }
+
+    for (i = 0; i < ec.num_trows; i++) {
+        text_row *tr = doc_get(&ec.doc, i);
+        int j;
+
+        for (j = tr->render_start; j < tr->render_size; j++) {
+            sum = sum * 31 + text_row_hl(tr, j);
+        }
+        sum += tr->highlight_open_comment;
+    }
+
+    printf("%-24s %8d rows %10.2f ms/pass  checksum %016lx\n", name,
+           ec.num_trows, best / 1e3, sum);
+}
+
+/**
+ * Times update_syntax over whole files, the ones given or a generated C file
+ * and Go file. Built as highlight_bench_sse2 too, with the SSE2 scan of runs
+ * of plain text.
+ */
+int main(int argc, char *argv[])
+{
+    int i;
+
+    if (argc < 2) {
+        ec.filename = "generated.c";
+        select_syntax_highlight();
+        generate(c_pieces, sizeof(c_pieces) / sizeof(*c_pieces));
+        run(ec.filename);
+
+        doc_free(&ec.doc);
+        ec.doc = (document)DOCUMENT_INIT;
+        ec.num_trows = 0;
+
+        ec.filename = "generated.go";
+        select_syntax_highlight();
+        generate(go_pieces, sizeof(go_pieces) / sizeof(*go_pieces));
+        run(ec.filename);
+
+        return EXIT_SUCCESS;
+    }
+
+    for (i = 1; i < argc; i++) {
+        ec.filename = argv[i];
+        select_syntax_highlight();
+
+        if (load(argv[i]) == -1) {
+            return EXIT_FAILURE;
+        }
+        run(ec.filename);
+
+        doc_free(&ec.doc);
+        ec.doc = (document)DOCUMENT_INIT;
+        ec.num_trows = 0;
+    }
+
+    return EXIT_SUCCESS;
+}
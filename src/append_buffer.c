@@ -5,18 +5,36 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define ABUF_MIN_CAP 64
+
 void buf_append(abuf *buf, const char *s, size_t len)
 {
-    char *new = (char *)realloc(buf->buf, buf->len + len);
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap ? buf->cap : ABUF_MIN_CAP;
+        while (cap < buf->len + len) {
+            cap *= 2;
+        }
+
+        char *new = (char *)realloc(buf->buf, cap);
+
+        if (new == NULL) {
+            perror("Failed to reallocate buffer for appending");
+            return;
+        }
 
-    if (new == NULL) {
-        perror("Failed to reallocate buffer for appending");
-        return;
+        buf->buf = new;
+        buf->cap = cap;
     }
 
-    memcpy(&new[buf->len], s, len);
-    buf->buf = new;
+    memcpy(&buf->buf[buf->len], s, len);
     buf->len += len;
 }
 
-void buf_free(abuf *bf) { FREE(bf->buf); }
+void buf_clear(abuf *buf) { buf->len = 0; }
+
+void buf_free(abuf *bf)
+{
+    FREE(bf->buf);
+    bf->len = 0;
+    bf->cap = 0;
+}
@@ -6,15 +6,22 @@
 typedef struct {
     char *buf;
     size_t len;
+    // bytes allocated, grown geometrically so appends are amortized O(1)
+    size_t cap;
 } abuf;
 
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 
 /**
  * Appends the string s to the end of the buffer.
  */
 void buf_append(abuf *buf, const char *s, size_t len);
 
+/**
+ * Empties the buffer, keeping its memory for what gets appended next.
+ */
+void buf_clear(abuf *buf);
+
 /**
  * Frees the allocated internal buffer
  */
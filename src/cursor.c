@@ -1,4 +1,7 @@
+#define _DEFAULT_SOURCE
+
 #include <assert.h>
+#include <poll.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -6,22 +9,87 @@
 #include "editor.h"
 #include "kbd.h"
 
+/**
+ * Returns the screen line of the wrapped rows the cursor is on, its column on
+ * that line going into col unless NULL.
+ */
+static long cursor_line(int *col)
+{
+    int rx = 0;
+    int line = 0;
+
+    if (ec.cy < ec.num_trows) {
+        text_row *row = doc_get(&ec.doc, ec.cy);
+        rx = row_cx_to_rx(row, ec.cx);
+        line = row_rx_to_line(row, rx);
+    }
+
+    if (col) {
+        *col = rx - line * ec.doc.wrap;
+    }
+
+    return doc_line(&ec.doc, ec.cy) + line;
+}
+
+void move_cursor_to_line(long line)
+{
+    long last = doc_line(&ec.doc, ec.num_trows) - 1;
+    int col;
+
+    if (ec.num_trows == 0) {
+        return;
+    }
+
+    cursor_line(&col);
+
+    if (line > last) {
+        line = last;
+    }
+
+    if (line < 0) {
+        line = 0;
+    }
+
+    int cy = doc_find_line(&ec.doc, &line);
+    text_row *row = doc_get(&ec.doc, cy);
+    int cx = row_rx_to_cx(row, line * ec.doc.wrap + col);
+
+    // a tab going over the start of the line is on the line before
+    if (cx < row->size && row_cx_to_rx(row, cx) < line * ec.doc.wrap) {
+        cx++;
+    }
+
+    ec.cy = cy;
+    ec.cx = cx;
+}
+
 void move_cursor(int key)
 {
     text_row *row = NULL;
 
     if (ec.cy < ec.num_trows) {
-        row = &ec.t_rows[ec.cy];
+        row = doc_get(&ec.doc, ec.cy);
     }
 
     switch (key) {
         case ARROW_UP:
-            if (ec.cy > 0) {
+            if (ec.wrap) {
+                // the row above gets measured for its last line to be found
+                if (ec.cy > 0) {
+                    render_row(ec.cy - 1);
+                }
+                long line = cursor_line(NULL);
+                if (line > 0) {
+                    move_cursor_to_line(line - 1);
+                }
+            } else if (ec.cy > 0) {
                 ec.cy--;
             }
             break;
         case ARROW_DOWN:
-            if (ec.cy < ec.num_trows - 1) {
+            if (ec.wrap) {
+                move_cursor_to_line(cursor_line(NULL) + 1);
+            } else if (ec.cy < ec.num_trows - 1) {
                 ec.cy++;
             }
             break;
@@ -31,7 +99,7 @@ void move_cursor(int key)
             } else if (ec.cy > 0) {
                 assert(ec.cx == 0);
                 ec.cy--;
-                int rs = ec.t_rows[ec.cy].size;
+                int rs = doc_get(&ec.doc, ec.cy)->size;
                 if (rs > 0) {
                     ec.cx = rs;
                 }
@@ -54,7 +122,7 @@ void move_cursor(int key)
     // change cursor pos to the end of the current row
     // if the actual cursor pos is bigger than row's length.
     if (ec.cy < ec.num_trows) {
-        row = &ec.t_rows[ec.cy];
+        row = doc_get(&ec.doc, ec.cy);
     }
 
     int row_len = row ? row->size : 0;
@@ -64,6 +132,30 @@ void move_cursor(int key)
     }
 }
 
+void move_cursor_to(int cy, int cx)
+{
+    if (cy > ec.num_trows - 1) {
+        cy = ec.num_trows - 1;
+    }
+
+    if (cy < 0) {
+        cy = 0;
+    }
+
+    int row_len = cy < ec.num_trows ? doc_get(&ec.doc, cy)->size : 0;
+
+    if (cx > row_len) {
+        cx = row_len;
+    }
+
+    if (cx < 0) {
+        cx = 0;
+    }
+
+    ec.cy = cy;
+    ec.cx = cx;
+}
+
 int get_cursor_pos(int *rows, int *cols)
 {
     char buf[32];
@@ -79,8 +171,11 @@ int get_cursor_pos(int *rows, int *cols)
 
     while (i < sizeof(buf) - 1) {
 
-        // read one character at a time from returned CPR "ESC[Pn;PnR"
-        if (read(STDIN_FILENO, &buf[i], 1) == -1) {
+        // read one character at a time from returned CPR "ESC[Pn;PnR",
+        // reads do not wait for it
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (poll(&pfd, 1, CURSOR_REPORT_TIMEOUT) != 1 ||
+            read(STDIN_FILENO, &buf[i], 1) != 1) {
             return -1;
         }
 
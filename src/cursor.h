@@ -1,6 +1,9 @@
 #ifndef INCLUDE_SRC_CURSOR_H_
 #define INCLUDE_SRC_CURSOR_H_
 
+// milliseconds waited for each byte of the terminal's cursor position report
+#define CURSOR_REPORT_TIMEOUT 1000
+
 /**
  * Gets cursor position in the window given its rows and columns count.
  */
@@ -11,4 +14,15 @@ int get_cursor_pos(int *rows, int *cols);
  */
 void move_cursor(int key);
 
+/**
+ * Moves the cursor to the given row and column, kept within the document.
+ */
+void move_cursor_to(int cy, int cx);
+
+/**
+ * Moves the cursor to the given screen line of the wrapped rows, kept within
+ * the document, at the same column on screen.
+ */
+void move_cursor_to_line(long line);
+
 #endif // INCLUDE_SRC_CURSOR_H_
@@ -0,0 +1,901 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "document.h"
+#include "util.h"
+
+#define DOC_NODE_MAX 32
+
+struct doc_node {
+    int is_leaf;
+    int n;     // rows in a leaf, children in an inner node
+    int count; // rows in the whole subtree
+    // no row below is wider, though some may have narrowed since
+    int widest;
+    // bytes in the whole subtree, each row counting its size and a line break
+    long bytes;
+    // screen lines the rows of the whole subtree take, see doc_row_lines
+    long lines;
+};
+
+typedef struct {
+    doc_node node;
+    // rows of the leaf, NULL until they get loaded through the document's
+    // loader, starting from first
+    text_row *rows;
+    long first;
+    // loaded leaves, most recently used first
+    doc_node *prev_used;
+    doc_node *next_used;
+} doc_leaf;
+
+typedef struct {
+    doc_node node;
+    doc_node *children[DOC_NODE_MAX];
+} doc_inner;
+
+#define LEAF(n) ((doc_leaf *)(n))
+#define INNER(n) ((doc_inner *)(n))
+
+static text_row *new_rows(void)
+{
+    text_row *rows = malloc(sizeof(text_row) * DOC_LEAF_ROWS);
+
+    if (!rows) {
+        DIE("Failed to allocate memory");
+    }
+
+    return rows;
+}
+
+static doc_node *new_node(int is_leaf)
+{
+    doc_node *node = malloc(is_leaf ? sizeof(doc_leaf) : sizeof(doc_inner));
+
+    if (!node) {
+        DIE("Failed to allocate memory");
+    }
+
+    node->is_leaf = is_leaf;
+    node->n = 0;
+    node->count = 0;
+    node->widest = 0;
+    node->bytes = 0;
+    node->lines = 0;
+
+    if (is_leaf) {
+        LEAF(node)->rows = new_rows();
+        LEAF(node)->first = 0;
+        LEAF(node)->prev_used = NULL;
+        LEAF(node)->next_used = NULL;
+    }
+
+    return node;
+}
+
+static int is_used(document *doc, doc_node *node)
+{
+    return doc->used == node || LEAF(node)->prev_used;
+}
+
+static void unlink_used(document *doc, doc_node *node)
+{
+    doc_leaf *leaf = LEAF(node);
+
+    if (!is_used(doc, node)) {
+        return;
+    }
+
+    if (leaf->prev_used) {
+        LEAF(leaf->prev_used)->next_used = leaf->next_used;
+    } else {
+        doc->used = leaf->next_used;
+    }
+
+    if (leaf->next_used) {
+        LEAF(leaf->next_used)->prev_used = leaf->prev_used;
+    } else {
+        doc->least_used = leaf->prev_used;
+    }
+
+    leaf->prev_used = NULL;
+    leaf->next_used = NULL;
+    doc->num_used--;
+}
+
+/**
+ * Moves a loaded leaf to the front of the used leaves.
+ */
+static void touch(document *doc, doc_node *node)
+{
+    if (doc->used == node) {
+        return;
+    }
+
+    unlink_used(doc, node);
+
+    LEAF(node)->next_used = doc->used;
+    if (doc->used) {
+        LEAF(doc->used)->prev_used = node;
+    } else {
+        doc->least_used = node;
+    }
+
+    doc->used = node;
+    doc->num_used++;
+}
+
+/**
+ * Loads the rows of a lazy leaf into the leaf for good, and marks the leaf as
+ * used.
+ */
+static void load_leaf(document *doc, doc_node *node)
+{
+    doc_leaf *leaf = LEAF(node);
+
+    touch(doc, node);
+
+    if (leaf->rows) {
+        return;
+    }
+
+    if (doc->peeked == node) {
+        // the rows were already loaded for a peek, take them over
+        leaf->rows = doc->scratch;
+        doc->scratch = NULL;
+        doc->peeked = NULL;
+        return;
+    }
+
+    leaf->rows = new_rows();
+    doc->load(leaf->first, node->n, leaf->rows);
+}
+
+static void free_node(document *doc, doc_node *node)
+{
+    if (node->is_leaf) {
+        unlink_used(doc, node);
+        free(LEAF(node)->rows);
+    }
+
+    free(node);
+}
+
+static int node_max(doc_node *node)
+{
+    return node->is_leaf ? DOC_LEAF_ROWS : DOC_NODE_MAX;
+}
+
+/**
+ * Drops the lookup caches, needed whenever nodes may have been split, merged
+ * or freed.
+ */
+static void invalidate_cache(document *doc)
+{
+    doc->cache_leaf = NULL;
+    doc->peeked = NULL;
+}
+
+static void widen(doc_node *node, int width)
+{
+    if (width > node->widest) {
+        node->widest = width;
+    }
+}
+
+static void remove_child(doc_inner *parent, int i)
+{
+    memmove(&parent->children[i], &parent->children[i + 1],
+            sizeof(doc_node *) * (parent->node.n - i - 1));
+    parent->node.n--;
+}
+
+/**
+ * Splits the child at index i of parent in two: the first `keep` rows (or
+ * children) stay where they are, the rest move into a new right sibling.
+ */
+static void split_child(document *doc, doc_inner *parent, int i, int keep)
+{
+    doc_node *left = parent->children[i];
+    doc_node *right = new_node(left->is_leaf);
+    int moved = left->n - keep;
+
+    if (left->is_leaf) {
+        load_leaf(doc, left);
+        memcpy(LEAF(right)->rows, &LEAF(left)->rows[keep],
+               sizeof(text_row) * moved);
+        right->count = moved;
+        int j;
+        for (j = 0; j < moved; ++j) {
+            text_row const *tr = &LEAF(right)->rows[j];
+            right->bytes += tr->size + 1;
+            right->lines += doc_row_lines(doc, tr);
+            widen(right, tr->width);
+        }
+        touch(doc, right);
+    } else {
+        memcpy(INNER(right)->children, &INNER(left)->children[keep],
+               sizeof(doc_node *) * moved);
+        int j;
+        for (j = 0; j < moved; ++j) {
+            doc_node const *child = INNER(right)->children[j];
+            right->count += child->count;
+            right->bytes += child->bytes;
+            right->lines += child->lines;
+            widen(right, child->widest);
+        }
+    }
+
+    right->n = moved;
+    left->n = keep;
+    left->count -= right->count;
+    left->bytes -= right->bytes;
+    left->lines -= right->lines;
+
+    memmove(&parent->children[i + 2], &parent->children[i + 1],
+            sizeof(doc_node *) * (parent->node.n - i - 1));
+    parent->children[i + 1] = right;
+    parent->node.n++;
+}
+
+/**
+ * Merges the child at index i + 1 of parent into the one at index i if they
+ * both fit in a single node. Leaves that were never loaded are left alone.
+ */
+static int merge_children(document *doc, doc_inner *parent, int i)
+{
+    doc_node *left = parent->children[i];
+    doc_node *right = parent->children[i + 1];
+
+    if (left->n + right->n > node_max(left)) {
+        return 0;
+    }
+
+    if (left->is_leaf) {
+        if (!LEAF(left)->rows || !LEAF(right)->rows) {
+            return 0;
+        }
+        memcpy(&LEAF(left)->rows[left->n], LEAF(right)->rows,
+               sizeof(text_row) * right->n);
+    } else {
+        memcpy(&INNER(left)->children[left->n], INNER(right)->children,
+               sizeof(doc_node *) * right->n);
+    }
+
+    left->n += right->n;
+    left->count += right->count;
+    left->bytes += right->bytes;
+    left->lines += right->lines;
+    widen(left, right->widest);
+    free_node(doc, right);
+    remove_child(parent, i + 1);
+    return 1;
+}
+
+/**
+ * Finds the leaf holding row at, which becomes the row's index in the leaf.
+ */
+static doc_node *find_leaf(document *doc, int *at)
+{
+    doc_node *node = doc->cache_leaf;
+
+    if (node && *at >= doc->cache_first && *at < doc->cache_first + node->n) {
+        *at -= doc->cache_first;
+        return node;
+    }
+
+    int first = 0;
+    node = doc->root;
+
+    while (!node->is_leaf) {
+        doc_inner *inner = INNER(node);
+        int i = 0;
+        while (*at >= inner->children[i]->count) {
+            *at -= inner->children[i]->count;
+            first += inner->children[i]->count;
+            i++;
+        }
+        node = inner->children[i];
+    }
+
+    doc->cache_leaf = node;
+    doc->cache_first = first;
+
+    return node;
+}
+
+text_row *doc_get(document *doc, int at)
+{
+    if (at < 0 || at >= doc->num_rows) {
+        return NULL;
+    }
+
+    doc_node *node = find_leaf(doc, &at);
+    load_leaf(doc, node);
+
+    return &LEAF(node)->rows[at];
+}
+
+/**
+ * Returns the rows of the leaf, loaded into scratch if the leaf is lazy.
+ */
+static text_row *peek_rows(document *doc, doc_node *node)
+{
+    if (LEAF(node)->rows) {
+        return LEAF(node)->rows;
+    }
+
+    if (doc->peeked != node) {
+        if (!doc->scratch) {
+            doc->scratch = new_rows();
+        }
+        doc->load(LEAF(node)->first, node->n, doc->scratch);
+        doc->peeked = node;
+    }
+
+    return doc->scratch;
+}
+
+text_row *doc_peek(document *doc, int at)
+{
+    if (at < 0 || at >= doc->num_rows) {
+        return NULL;
+    }
+
+    doc_node *node = find_leaf(doc, &at);
+
+    return &peek_rows(doc, node)[at];
+}
+
+long doc_offset(document *doc, int at)
+{
+    if (at < 0 || at > doc->num_rows) {
+        return -1;
+    }
+
+    if (at == doc->num_rows) {
+        return doc->root ? doc->root->bytes : 0;
+    }
+
+    doc_node *node = doc->root;
+    long offset = 0;
+    int i;
+
+    while (!node->is_leaf) {
+        doc_inner *inner = INNER(node);
+        i = 0;
+        while (at >= inner->children[i]->count) {
+            at -= inner->children[i]->count;
+            offset += inner->children[i]->bytes;
+            i++;
+        }
+        node = inner->children[i];
+    }
+
+    text_row *rows = peek_rows(doc, node);
+
+    for (i = 0; i < at; i++) {
+        offset += rows[i].size + 1;
+    }
+
+    return offset;
+}
+
+int doc_find_offset(document *doc, long *offset)
+{
+    if (!doc->root || *offset < 0) {
+        *offset = 0;
+        return 0;
+    }
+
+    doc_node *node = doc->root;
+    int at = 0;
+    int i;
+
+    while (!node->is_leaf) {
+        doc_inner *inner = INNER(node);
+        i = 0;
+        while (i < node->n - 1 && *offset >= inner->children[i]->bytes) {
+            *offset -= inner->children[i]->bytes;
+            at += inner->children[i]->count;
+            i++;
+        }
+        node = inner->children[i];
+    }
+
+    text_row *rows = peek_rows(doc, node);
+
+    for (i = 0; i < node->n - 1 && *offset > rows[i].size; i++) {
+        *offset -= rows[i].size + 1;
+    }
+
+    // past the end of the document
+    if (*offset > rows[i].size) {
+        *offset = rows[i].size;
+    }
+
+    return at + i;
+}
+
+void doc_resize(document *doc, int at, int by)
+{
+    if (at < 0 || at >= doc->num_rows) {
+        return;
+    }
+
+    doc_node *node = doc->root;
+
+    while (!node->is_leaf) {
+        doc_inner *inner = INNER(node);
+        int i = 0;
+        while (at >= inner->children[i]->count) {
+            at -= inner->children[i]->count;
+            i++;
+        }
+        node->bytes += by;
+        node = inner->children[i];
+    }
+
+    node->bytes += by;
+}
+
+long doc_line(document *doc, int at)
+{
+    if (at < 0 || at > doc->num_rows) {
+        return -1;
+    }
+
+    if (at == doc->num_rows) {
+        return doc->root ? doc->root->lines : 0;
+    }
+
+    doc_node *node = doc->root;
+    long line = 0;
+    int i;
+
+    while (!node->is_leaf) {
+        doc_inner *inner = INNER(node);
+        i = 0;
+        while (at >= inner->children[i]->count) {
+            at -= inner->children[i]->count;
+            line += inner->children[i]->lines;
+            i++;
+        }
+        node = inner->children[i];
+    }
+
+    text_row *rows = peek_rows(doc, node);
+
+    for (i = 0; i < at; i++) {
+        line += doc_row_lines(doc, &rows[i]);
+    }
+
+    return line;
+}
+
+int doc_find_line(document *doc, long *line)
+{
+    if (!doc->root || *line < 0) {
+        *line = 0;
+        return 0;
+    }
+
+    doc_node *node = doc->root;
+    int at = 0;
+    int i;
+
+    while (!node->is_leaf) {
+        doc_inner *inner = INNER(node);
+        i = 0;
+        while (i < node->n - 1 && *line >= inner->children[i]->lines) {
+            *line -= inner->children[i]->lines;
+            at += inner->children[i]->count;
+            i++;
+        }
+        node = inner->children[i];
+    }
+
+    text_row *rows = peek_rows(doc, node);
+
+    for (i = 0; i < node->n - 1 && *line >= doc_row_lines(doc, &rows[i]);
+         i++) {
+        *line -= doc_row_lines(doc, &rows[i]);
+    }
+
+    // past the end of the document
+    if (*line >= doc_row_lines(doc, &rows[i])) {
+        *line = doc_row_lines(doc, &rows[i]) - 1;
+    }
+
+    return at + i;
+}
+
+void doc_set_width(document *doc, int at, int width)
+{
+    text_row *tr = doc_get(doc, at);
+
+    if (!tr) {
+        return;
+    }
+
+    int before = doc_row_lines(doc, tr);
+    tr->width = width;
+    int by = doc_row_lines(doc, tr) - before;
+    doc_node *node = doc->root;
+
+    while (!node->is_leaf) {
+        doc_inner *inner = INNER(node);
+        int i = 0;
+        while (at >= inner->children[i]->count) {
+            at -= inner->children[i]->count;
+            i++;
+        }
+        node->lines += by;
+        widen(node, width);
+        node = inner->children[i];
+    }
+
+    node->lines += by;
+    widen(node, width);
+}
+
+/**
+ * Counts the lines of the rows below the node again if some of them are wider
+ * than either the old or the new wrap width, the other rows take a single
+ * line both before and after.
+ */
+static void rewrap(document *doc, doc_node *node, int old)
+{
+    if ((!old || node->widest <= old) &&
+        (!doc->wrap || node->widest <= doc->wrap)) {
+        return;
+    }
+
+    node->lines = 0;
+    node->widest = 0;
+
+    int i;
+
+    if (!node->is_leaf) {
+        for (i = 0; i < node->n; i++) {
+            doc_node *child = INNER(node)->children[i];
+            rewrap(doc, child, old);
+            node->lines += child->lines;
+            widen(node, child->widest);
+        }
+        return;
+    }
+
+    // the rows of a lazy leaf come back unmeasured
+    if (!LEAF(node)->rows) {
+        node->lines = node->n;
+        return;
+    }
+
+    for (i = 0; i < node->n; i++) {
+        node->lines += doc_row_lines(doc, &LEAF(node)->rows[i]);
+        widen(node, LEAF(node)->rows[i].width);
+    }
+}
+
+void doc_wrap(document *doc, int width)
+{
+    int old = doc->wrap;
+
+    doc->wrap = width;
+    invalidate_cache(doc);
+
+    if (doc->root && width != old) {
+        rewrap(doc, doc->root, old);
+    }
+}
+
+/**
+ * Returns whether the node has to be split before n rows get inserted below
+ * it, an inner node gaining at most one child on the way.
+ */
+static int is_full(doc_node *node, int n)
+{
+    return node->n + (node->is_leaf ? n : 1) > node_max(node);
+}
+
+/**
+ * Opens n consecutive slots in a single leaf for rows taking the given number
+ * of bytes at the given position and returns the first one. There can be up
+ * to half a leaf of them, which any leaf split on the way down has room for.
+ */
+static text_row *open_slots(document *doc, int at, int n, long bytes)
+{
+    invalidate_cache(doc);
+
+    if (!doc->root) {
+        doc->root = new_node(1);
+    }
+
+    // grow the tree from the top, the old root becomes the only child of a
+    // new one and gets split on the way down like any other full node
+    if (is_full(doc->root, n)) {
+        doc_node *root = new_node(0);
+        INNER(root)->children[0] = doc->root;
+        root->n = 1;
+        root->count = doc->root->count;
+        root->widest = doc->root->widest;
+        root->bytes = doc->root->bytes;
+        root->lines = doc->root->lines;
+        doc->root = root;
+    }
+
+    doc_node *node = doc->root;
+
+    while (!node->is_leaf) {
+        doc_inner *inner = INNER(node);
+        int i = 0;
+
+        while (i < node->n - 1 && at > inner->children[i]->count) {
+            at -= inner->children[i]->count;
+            i++;
+        }
+
+        doc_node *child = inner->children[i];
+
+        if (is_full(child, n)) {
+            // appending (loading a file, typing at the end) leaves the
+            // left half full instead of half empty
+            int append = (at == child->count);
+            int keep = append ? child->n - !child->is_leaf : child->n / 2;
+
+            split_child(doc, inner, i, keep);
+
+            if (at > child->count || (append && child->is_leaf)) {
+                at -= child->count;
+                i++;
+            }
+        }
+
+        node->count += n;
+        node->bytes += bytes;
+        node->lines += n;
+        node = inner->children[i];
+    }
+
+    load_leaf(doc, node);
+
+    doc_leaf *leaf = LEAF(node);
+    memmove(&leaf->rows[at + n], &leaf->rows[at],
+            sizeof(text_row) * (node->n - at));
+    node->n += n;
+    node->count += n;
+    node->bytes += bytes;
+    node->lines += n;
+    doc->num_rows += n;
+
+    return &leaf->rows[at];
+}
+
+text_row *doc_insert(document *doc, int at, int size)
+{
+    if (at < 0 || at > doc->num_rows) {
+        return NULL;
+    }
+
+    return open_slots(doc, at, 1, size + 1);
+}
+
+void doc_insert_rows(document *doc, int at, int n, text_row const *rows)
+{
+    if (at < 0 || at > doc->num_rows) {
+        return;
+    }
+
+    while (n > 0) {
+        int chunk = n < DOC_LEAF_ROWS / 2 ? n : DOC_LEAF_ROWS / 2;
+        long bytes = 0;
+        int i;
+
+        for (i = 0; i < chunk; i++) {
+            bytes += rows[i].size + 1;
+        }
+
+        text_row *slots = open_slots(doc, at, chunk, bytes);
+        memcpy(slots, rows, sizeof(text_row) * chunk);
+
+        for (i = 0; i < chunk; i++) {
+            slots[i].width = 0;
+        }
+
+        at += chunk;
+        rows += chunk;
+        n -= chunk;
+    }
+}
+
+/**
+ * Appends the leaf at the end of the subtree, returns a new right sibling for
+ * node if it was too full to take it.
+ */
+static doc_node *append_leaf(doc_node *node, doc_node *leaf)
+{
+    doc_inner *inner = INNER(node);
+    doc_node *child = leaf;
+    doc_node *last = inner->children[node->n - 1];
+
+    node->count += leaf->count;
+    node->bytes += leaf->bytes;
+    node->lines += leaf->lines;
+
+    if (!last->is_leaf) {
+        child = append_leaf(last, leaf);
+        if (!child) {
+            return NULL;
+        }
+    }
+
+    if (node->n < DOC_NODE_MAX) {
+        inner->children[node->n++] = child;
+        return NULL;
+    }
+
+    doc_node *sibling = new_node(0);
+    INNER(sibling)->children[0] = child;
+    sibling->n = 1;
+    sibling->count = child->count;
+    sibling->widest = child->widest;
+    sibling->bytes = child->bytes;
+    sibling->lines = child->lines;
+    node->count -= child->count;
+    node->bytes -= child->bytes;
+    node->lines -= child->lines;
+
+    return sibling;
+}
+
+void doc_append_lazy(document *doc, long first, int n, long bytes)
+{
+    doc_node *leaf = malloc(sizeof(doc_leaf));
+
+    if (!leaf) {
+        DIE("Failed to allocate memory");
+    }
+
+    leaf->is_leaf = 1;
+    leaf->n = n;
+    leaf->count = n;
+    leaf->widest = 0;
+    leaf->bytes = bytes;
+    leaf->lines = n;
+    LEAF(leaf)->rows = NULL;
+    LEAF(leaf)->first = first;
+    LEAF(leaf)->prev_used = NULL;
+    LEAF(leaf)->next_used = NULL;
+
+    invalidate_cache(doc);
+    doc->num_rows += n;
+
+    if (!doc->root) {
+        doc->root = leaf;
+        return;
+    }
+
+    doc_node *sibling = doc->root->is_leaf ? leaf : append_leaf(doc->root, leaf);
+
+    if (sibling) {
+        doc_node *root = new_node(0);
+        INNER(root)->children[0] = doc->root;
+        INNER(root)->children[1] = sibling;
+        root->n = 2;
+        root->count = doc->root->count + sibling->count;
+        root->widest = doc->root->widest;
+        widen(root, sibling->widest);
+        root->bytes = doc->root->bytes + sibling->bytes;
+        root->lines = doc->root->lines + sibling->lines;
+        doc->root = root;
+    }
+}
+
+/**
+ * Removes the row at the given position of the subtree, which counted for the
+ * given bytes and lines.
+ */
+static void remove_at(document *doc, doc_node *node, int at, long bytes,
+                      int lines)
+{
+    node->count--;
+    node->bytes -= bytes;
+    node->lines -= lines;
+
+    if (node->is_leaf) {
+        memmove(&LEAF(node)->rows[at], &LEAF(node)->rows[at + 1],
+                sizeof(text_row) * (node->n - at - 1));
+        node->n--;
+        return;
+    }
+
+    doc_inner *inner = INNER(node);
+    int i = 0;
+
+    while (at >= inner->children[i]->count) {
+        at -= inner->children[i]->count;
+        i++;
+    }
+
+    doc_node *child = inner->children[i];
+    remove_at(doc, child, at, bytes, lines);
+
+    if (child->n == 0) {
+        free_node(doc, child);
+        remove_child(inner, i);
+    } else if (child->n < node_max(child) / 4) {
+        if (i + 1 >= node->n || !merge_children(doc, inner, i)) {
+            if (i > 0) {
+                merge_children(doc, inner, i - 1);
+            }
+        }
+    }
+}
+
+void doc_remove(document *doc, int at)
+{
+    if (at < 0 || at >= doc->num_rows) {
+        return;
+    }
+
+    text_row *tr = doc_get(doc, at);
+    long bytes = tr->size + 1;
+    int lines = doc_row_lines(doc, tr);
+
+    invalidate_cache(doc);
+
+    remove_at(doc, doc->root, at, bytes, lines);
+    doc->num_rows--;
+
+    while (!doc->root->is_leaf && doc->root->n == 1) {
+        doc_node *root = doc->root;
+        doc->root = INNER(root)->children[0];
+        free(root);
+    }
+
+    if (doc->root->n == 0) {
+        free_node(doc, doc->root);
+        doc->root = NULL;
+    }
+}
+
+void doc_trim(document *doc, int keep, doc_unloader unload)
+{
+    while (doc->num_used > keep) {
+        doc_node *node = doc->least_used;
+        doc_leaf *leaf = LEAF(node);
+        long first = unload(leaf->rows, node->n);
+
+        unlink_used(doc, node);
+
+        // rows taking more than a line would come back counting a single one
+        if (first >= 0 && node->lines == node->n) {
+            FREE(leaf->rows);
+            leaf->first = first;
+        }
+    }
+}
+
+static void free_tree(document *doc, doc_node *node)
+{
+    if (!node->is_leaf) {
+        int i;
+        for (i = 0; i < node->n; ++i) {
+            free_tree(doc, INNER(node)->children[i]);
+        }
+    }
+
+    free_node(doc, node);
+}
+
+void doc_free(document *doc)
+{
+    if (doc->root) {
+        free_tree(doc, doc->root);
+    }
+
+    free(doc->scratch);
+    slab_release(&doc->mem);
+    *doc = (document)DOCUMENT_INIT;
+}
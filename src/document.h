@@ -0,0 +1,220 @@
+#ifndef INCLUDE_SRC_DOCUMENT_H_
+#define INCLUDE_SRC_DOCUMENT_H_
+
+#include "slab.h"
+
+#define DOC_LEAF_ROWS 64
+
+// the row's content points into the opened file instead of owning a buffer
+#define ROW_MAPPED (1 << 0)
+// the render and highlight of the row only cover the columns in
+// [render_start, render_size) around the screen, see render_row
+#define ROW_WINDOW (1 << 1)
+
+typedef struct column_index column_index;
+
+typedef struct {
+    int flags;
+    int size;
+    int render_size;
+    int render_cap;
+    // content is a gap buffer: the first gap_start characters of the row are
+    // followed by gap_len unused bytes and then by the rest of the row
+    char *content;
+    int gap_start;
+    int gap_len;
+    // rows without tabs render straight from their content and have no
+    // to_render of their own
+    char *to_render;
+    // packed highlight classes, NULL until the row is shown or edited, it
+    // shares a single block with to_render
+    unsigned char *highlight;
+    // -1 until the row gets highlighted
+    int highlight_open_comment;
+    // first column the render starts at, 0 unless the row has a window
+    int render_start;
+    // columns of every so many characters of a long row, NULL until one is
+    // looked up on it
+    column_index *columns;
+    // columns the row takes on screen as last measured, see doc_set_width, 0
+    // until then
+    int width;
+} text_row;
+
+/**
+ * Returns the character at position i of the row's content.
+ */
+static inline char text_row_char(text_row const *tr, int i)
+{
+    return tr->content[i < tr->gap_start ? i : i + tr->gap_len];
+}
+
+/**
+ * Returns the character at index i of the row's render, or the null byte
+ * outside of it.
+ */
+static inline char text_row_render_char(text_row const *tr, int i)
+{
+    if (i >= tr->render_size || i < tr->render_start) {
+        return '\0';
+    }
+
+    return tr->to_render ? tr->to_render[i - tr->render_start]
+                         : text_row_char(tr, i);
+}
+
+typedef struct doc_node doc_node;
+
+/**
+ * Fills in the n rows of a lazy leaf, first being the value the leaf was
+ * appended with.
+ */
+typedef void (*doc_loader)(long first, int n, text_row *rows);
+
+/**
+ * Lets go of what the n rows of a leaf keep that can be recomputed, returns
+ * the value to load them back with through the document's loader if the rows
+ * themselves can go too, -1 otherwise.
+ */
+typedef long (*doc_unloader)(text_row *rows, int n);
+
+/**
+ * Rows of the opened file, kept in a counted B+ tree: leaves hold the rows
+ * themselves and every node knows how many rows and bytes live below it, so
+ * looking up, inserting or deleting a row by its line number, or finding it by
+ * its byte offset, is O(log n).
+ *
+ * Nodes also count the screen lines their rows take once wrapped, which maps
+ * rows and screen lines to each other in O(log n) as well.
+ *
+ * Leaves can also be lazy, their rows are then only loaded on first lookup.
+ */
+typedef struct {
+    doc_node *root;
+    int num_rows;
+    doc_loader load;
+    // last leaf a row was looked up in, makes sequential access O(1)
+    doc_node *cache_leaf;
+    int cache_first;
+    // lazy leaf whose rows were loaded into scratch by doc_peek
+    doc_node *peeked;
+    text_row *scratch;
+    // loaded leaves in order of use
+    doc_node *used;
+    doc_node *least_used;
+    int num_used;
+    // buffers of the rows
+    slab mem;
+    // columns rows get wrapped at, 0 if they are not
+    int wrap;
+} document;
+
+#define DOCUMENT_INIT                                                          \
+    {NULL, 0, NULL, NULL, 0, NULL, NULL, NULL, NULL, 0, SLAB_INIT, 0}
+
+/**
+ * Returns the number of screen lines the row takes, one unless it is wider
+ * than the wrap width.
+ */
+static inline int doc_row_lines(document const *doc, text_row const *tr)
+{
+    if (!doc->wrap || tr->width <= doc->wrap) {
+        return 1;
+    }
+
+    return (tr->width - 1) / doc->wrap + 1;
+}
+
+/**
+ * Returns the row at the given position, the pointer stays valid until the
+ * next structural change (insertion or deletion of a row).
+ */
+text_row *doc_get(document *doc, int at);
+
+/**
+ * Returns the row at the given position without loading it into the document
+ * for good if it lives in a lazy leaf, the pointer is only valid until the
+ * next lookup.
+ */
+text_row *doc_peek(document *doc, int at);
+
+/**
+ * Returns the byte offset of the row at the given position, rows counting
+ * their size and a line break.
+ */
+long doc_offset(document *doc, int at);
+
+/**
+ * Returns the position of the row holding the given byte offset, which
+ * becomes the offset within the row.
+ */
+int doc_find_offset(document *doc, long *offset);
+
+/**
+ * Returns the first screen line of the row at the given position.
+ */
+long doc_line(document *doc, int at);
+
+/**
+ * Returns the position of the row holding the given screen line, which
+ * becomes the line within the row.
+ */
+int doc_find_line(document *doc, long *line);
+
+/**
+ * Sets the width of the row at the given position, which the screen lines
+ * counted for it follow.
+ */
+void doc_set_width(document *doc, int at, int width);
+
+/**
+ * Wraps rows at the given width from now on, or not at all if 0. Only the
+ * lines of rows wider than either width get counted again.
+ */
+void doc_wrap(document *doc, int width);
+
+/**
+ * Tells the document that the size of the row at the given position changed
+ * by the given number of bytes.
+ */
+void doc_resize(document *doc, int at, int by);
+
+/**
+ * Opens a slot for a new row of the given size at the given position and
+ * returns it, the returned row is left uninitialized for the caller to fill
+ * in, with a width of 0 as it counts a single line.
+ */
+text_row *doc_insert(document *doc, int at, int size);
+
+/**
+ * Inserts copies of the n given rows at the given position, filling leaves
+ * a chunk of rows at a time instead of walking down the tree for each row.
+ * The copies are left unmeasured.
+ */
+void doc_insert_rows(document *doc, int at, int n, text_row const *rows);
+
+/**
+ * Removes the row slot at the given position, the row's own buffers are not
+ * freed.
+ */
+void doc_remove(document *doc, int at);
+
+/**
+ * Appends a lazy leaf of n rows (at most DOC_LEAF_ROWS) taking the given
+ * number of bytes at the end of the document, the rows get loaded by handing
+ * first to the document's loader.
+ */
+void doc_append_lazy(document *doc, long first, int n, long bytes);
+
+/**
+ * Hands the rows of all but the keep most recently used leaves to unload,
+ * which invalidates every row pointer.
+ */
+void doc_trim(document *doc, int keep, doc_unloader unload);
+
+/**
+ * Frees the whole document, including the buffers of its rows.
+ */
+void doc_free(document *doc);
+
+#endif // INCLUDE_SRC_DOCUMENT_H_
@@ -8,23 +8,60 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "append_buffer.h"
 #include "cursor.h"
 #include "editor.h"
+#include "event.h"
 #include "find.h"
+#include "goto.h"
 #include "highlight.h"
+#include "highlight_worker.h"
 #include "kbd.h"
+#include "loader.h"
+#include "log.h"
+#include "screen.h"
 #include "status_bar.h"
 #include "util.h"
 
 editor_config ec;
 int quit_times = EDITOR_UNSAVED_QUIT_TIMES;
+static volatile sig_atomic_t win_resized;
+// first line on screen in the last frame drawn, see screen_top
+static long drawn_top;
+// rows an edit left to highlight later: the one at pending_from and those
+// below it may end in another multiline comment state than they were
+// highlighted with, down to at least the one at pending_to, see
+// update_syntax_from. -1 if there are none
+static int pending_from = -1;
+static int pending_to;
+// rows before this one all got highlighted, unless the file is only viewed:
+// its rows forget their state once unloaded, it keeps the states the rows
+// before HIGHLIGHT_SLICE, 2 * HIGHLIGHT_SLICE and so on end with instead, the
+// first num_checkpoints of them being known
+static int highlighted_to;
+static unsigned char *checkpoints;
+static int num_checkpoints;
+static int checkpoints_cap;
+// furthest row shown before the states of the rows above it were known, -1
+// once the highlight worker went over them
+static int highlight_wanted = -1;
+// rows handed to the highlight worker, job_n being 0 if none, whether they
+// were left for later by an edit, and the states it worked out for them while
+// they get taken in
+static int job_first;
+static int job_n;
+static int job_open_comment;
+static int job_pending;
+static unsigned char const *job_states;
 
 void init_editor(void)
 {
@@ -35,12 +72,17 @@ void init_editor(void)
     ec.cy = 0;
     ec.rx = 0;
     ec.num_trows = 0;
-    ec.t_rows = NULL;
+    ec.doc = (document)DOCUMENT_INIT;
     ec.row_offset = 0;
     ec.col_offset = 0;
+    ec.wrap = 0;
+    ec.wrap_offset = 0;
     ec.filename = NULL;
+    ec.map = NULL;
+    ec.map_size = 0;
     ec.status_msg[0] = '\0';
     ec.dirty = 0;
+    ec.read_only = 0;
     ec.prompting = 0;
     ec.syntax = NULL;
     ec.line_number_padding = 0;
@@ -52,7 +94,7 @@ void init_editor(void)
     // leave one line for status line and another for status msg
     ec.rows -= 2;
 
-    set_status_msg("Help: ^s Save | ^q Quit | ^f Find");
+    set_status_msg("Help: ^s Save | ^q Quit | ^f Find | ^g Go to | ^w Wrap");
 }
 
 int get_window_size(int *rows, int *cols)
@@ -71,63 +113,1074 @@ int get_window_size(int *rows, int *cols)
     return 0;
 }
 
+/**
+ * Loads n rows from the mapping of the opened file, starting with the line at
+ * offset first. The rows borrow their content from the mapping.
+ */
+static void load_mapped_rows(long first, int n, text_row *rows)
+{
+    char const *p = ec.map + first;
+    char const *end = ec.map + ec.map_size;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        char const *nl = memchr(p, '\n', end - p);
+        int len = (nl ? nl : end) - p;
+
+        while (len > 0 && p[len - 1] == '\r') {
+            len--;
+        }
+
+        rows[i].flags = ROW_MAPPED;
+        rows[i].size = len;
+        rows[i].content = (char *)p;
+        rows[i].gap_start = len;
+        rows[i].gap_len = 0;
+        rows[i].render_size = 0;
+        rows[i].render_cap = 0;
+        rows[i].to_render = NULL;
+        rows[i].highlight = NULL;
+        rows[i].highlight_open_comment = -1;
+        rows[i].render_start = 0;
+        rows[i].columns = NULL;
+        rows[i].width = 0;
+
+        p = nl ? nl + 1 : end;
+    }
+}
+
+/**
+ * Stops the highlight worker and forgets the highlight states kept aside from
+ * the rows, before the file or its syntax change.
+ */
+static void stop_highlight(void)
+{
+    highlight_worker_stop();
+    job_n = 0;
+    pending_from = -1;
+    highlighted_to = 0;
+    highlight_wanted = -1;
+    num_checkpoints = 0;
+}
+
+/**
+ * Releases the opened file along with the buffers of all of its rows.
+ */
+static void close_file(void)
+{
+    loader_stop();
+    stop_highlight();
+    doc_free(&ec.doc);
+    ec.num_trows = 0;
+
+    if (ec.map) {
+        munmap((void *)ec.map, ec.map_size);
+        ec.map = NULL;
+        ec.map_size = 0;
+    }
+}
+
 void open_file(char *filename)
 {
-    FREE(ec.filename);
-    ec.filename = strdup(filename);
+    close_file();
+
+    FREE(ec.filename);
+    ec.filename = strdup(filename);
+
+    // select syntax highlighting based on file type
+    select_syntax_highlight();
+
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        DIE("Failed to open file");
+    }
+
+    if (st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map == MAP_FAILED) {
+            DIE("Failed to map file");
+        }
+
+        ec.map = map;
+        ec.map_size = st.st_size;
+        ec.doc.load = load_mapped_rows;
+
+        loader_start();
+    }
+
+    // the mapping stays valid once the file is closed
+    close(fd);
+    ec.dirty = 0;
+}
+
+// where a character of a row is
+typedef struct {
+    int rx;  // on screen, see row_cx_to_rx
+    int idx; // in the render
+} column;
+
+struct column_index {
+    int cap;
+    // columns of the characters at positions 0, COLUMN_STEP, 2 * COLUMN_STEP
+    // and so on, the first len of them are up to date
+    int len;
+    column at[];
+};
+
+#define COLUMN_INDEX_BYTES(n) (sizeof(column_index) + sizeof(column) * (n))
+
+/**
+ * Frees the column index of the row.
+ */
+static void text_row_drop_columns(text_row *tr)
+{
+    if (tr->columns) {
+        slab_free(&ec.doc.mem, tr->columns,
+                  COLUMN_INDEX_BYTES(tr->columns->cap));
+        tr->columns = NULL;
+    }
+}
+
+/**
+ * Tells the column index of the row that its content changed from position
+ * pos on, the columns of the characters before it stay the same.
+ */
+static void text_row_forget_columns(text_row *tr, int pos)
+{
+    if (!tr->columns) {
+        return;
+    }
+
+    if (tr->size <= COLUMN_STEP) {
+        text_row_drop_columns(tr);
+    } else if (tr->columns->len > pos / COLUMN_STEP + 1) {
+        tr->columns->len = pos / COLUMN_STEP + 1;
+    }
+}
+
+/**
+ * Frees the render and highlight of the row, they can be computed again from
+ * its content.
+ */
+static void text_row_drop_render(text_row *tr)
+{
+    if (tr->to_render) {
+        slab_free(&ec.doc.mem, tr->to_render,
+                  tr->render_cap + HL_BYTES(tr->render_cap));
+    } else {
+        slab_free(&ec.doc.mem, tr->highlight, HL_BYTES(tr->render_cap));
+    }
+    tr->to_render = NULL;
+    tr->highlight = NULL;
+    tr->render_size = 0;
+    tr->render_cap = 0;
+    tr->render_start = 0;
+    tr->flags &= ~ROW_WINDOW;
+}
+
+void free_text_row(text_row *tr)
+{
+    if (!(tr->flags & ROW_MAPPED)) {
+        slab_free(&ec.doc.mem, tr->content, tr->size + tr->gap_len);
+    }
+    tr->content = NULL;
+
+    text_row_drop_render(tr);
+    text_row_drop_columns(tr);
+}
+
+void release_mapped(char const *from, char const *to)
+{
+    // the kernel maps the pages around a faulting one along with it, in
+    // aligned blocks of this many bytes
+    uintptr_t block = 64 * 1024;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t lo = (uintptr_t)ec.map;
+    uintptr_t hi = ((uintptr_t)ec.map + ec.map_size + page - 1) & ~(page - 1);
+    // the mapping is never written to, so pages shared with rows still in
+    // use can go too
+    uintptr_t start = (uintptr_t)from & ~(block - 1);
+    uintptr_t end = ((uintptr_t)to + block - 1) & ~(block - 1);
+
+    start = start < lo ? lo : start;
+    end = end > hi ? hi : end;
+
+    if (start < end) {
+        madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+}
+
+/**
+ * Drops the renders of rows that have not been used for a while, the rows
+ * themselves can go too if they still are consecutive lines of the mapped
+ * file and no highlight state depends on them.
+ *
+ * Nothing gets edited when the file is only viewed, so highlight states stay
+ * right and can be computed again, and the pages of the rows go as well.
+ */
+static long unload_rows(text_row *rows, int n)
+{
+    int keep = !ec.map;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        text_row *tr = &rows[i];
+
+        text_row_drop_render(tr);
+        text_row_drop_columns(tr);
+
+        if (keep || !(tr->flags & ROW_MAPPED) ||
+            (!ec.read_only && ec.syntax && tr->highlight_open_comment >= 0)) {
+            keep = 1;
+            continue;
+        }
+
+        if (i + 1 < n) {
+            char const *end = ec.map + ec.map_size;
+            char const *nl = memchr(&tr->content[tr->size], '\n',
+                                    end - &tr->content[tr->size]);
+            keep = !nl || rows[i + 1].content != nl + 1;
+        }
+    }
+
+    if (keep) {
+        return -1;
+    }
+
+    if (ec.read_only) {
+        release_mapped(rows[0].content, &rows[n - 1].content[rows[n - 1].size]);
+    }
+
+    return rows[0].content - ec.map;
+}
+
+/**
+ * Copies the content of a row still pointing into the opened file into a
+ * buffer of its own, before it gets edited.
+ */
+static void text_row_own(text_row *tr)
+{
+    if (!(tr->flags & ROW_MAPPED)) {
+        return;
+    }
+
+    int cap = slab_size(tr->size + 1);
+    char *content = slab_alloc(&ec.doc.mem, cap);
+
+    memcpy(content, tr->content, tr->size);
+    tr->content = content;
+    tr->gap_start = tr->size;
+    tr->gap_len = cap - tr->size;
+    tr->flags &= ~ROW_MAPPED;
+}
+
+/**
+ * Moves the gap of the row's content to the given position.
+ */
+static void text_row_move_gap(text_row *tr, int pos)
+{
+    if (pos != tr->gap_start) {
+        text_row_own(tr);
+    }
+
+    if (pos < tr->gap_start) {
+        memmove(&tr->content[pos + tr->gap_len], &tr->content[pos],
+                tr->gap_start - pos);
+    } else if (pos > tr->gap_start) {
+        memmove(&tr->content[tr->gap_start],
+                &tr->content[tr->gap_start + tr->gap_len],
+                pos - tr->gap_start);
+    }
+
+    tr->gap_start = pos;
+}
+
+/**
+ * Makes room in the gap for len more characters. The buffer grows
+ * geometrically so inserting at the cursor is amortized O(1), long rows by
+ * LONG_ROW_SIZE at most.
+ */
+static void text_row_reserve(text_row *tr, int len)
+{
+    text_row_own(tr);
+
+    if (tr->gap_len >= len) {
+        return;
+    }
+
+    int cap = tr->size + tr->gap_len;
+    int want = cap * 2 > tr->size + len ? cap * 2 : tr->size + len;
+
+    // long rows get a bounded amount of room instead of twice their size
+    if (want > tr->size + len + LONG_ROW_SIZE) {
+        want = tr->size + len + LONG_ROW_SIZE;
+    }
+
+    int new_cap = slab_size(want);
+    char *content = slab_realloc(&ec.doc.mem, tr->content, cap, new_cap, cap);
+
+    // keep the part after the gap at the end of the buffer
+    int after = tr->size - tr->gap_start;
+    memmove(&content[new_cap - after], &content[tr->gap_start + tr->gap_len],
+            after);
+
+    tr->content = content;
+    tr->gap_len = new_cap - tr->size;
+}
+
+/**
+ * Makes the highlight of the row big enough for size columns, along with a
+ * render of its own for size characters and the terminating null byte if the
+ * row has tabs. What was rendered and highlighted so far is kept.
+ */
+static void text_row_reserve_render(text_row *tr, int size, int tabs)
+{
+    if (tr->highlight && tr->render_cap > size && !tr->to_render == !tabs) {
+        return;
+    }
+
+    int cap = tr->render_cap;
+
+    if (cap <= size) {
+        cap = cap * 2 > size + 1 ? cap * 2 : size + 1;
+    }
+
+    // the highlight follows the render in the same block
+    char *block = slab_alloc(&ec.doc.mem, (tabs ? cap : 0) + HL_BYTES(cap));
+    unsigned char *highlight = (unsigned char *)&block[tabs ? cap : 0];
+
+    if (tr->highlight) {
+        if (tabs && tr->to_render) {
+            memcpy(block, tr->to_render, tr->render_cap);
+        }
+        memcpy(highlight, tr->highlight, HL_BYTES(tr->render_cap));
+
+        int render_size = tr->render_size;
+        text_row_drop_render(tr);
+        tr->render_size = render_size;
+    }
+
+    tr->to_render = tabs ? block : NULL;
+    tr->highlight = highlight;
+    tr->render_cap = cap;
+}
+
+/**
+ * Moves the highlight of the columns from index from to the end of the row by
+ * the given number of columns.
+ */
+static void text_row_shift_hl(text_row *tr, int from, int by)
+{
+    unsigned char *hl = tr->highlight;
+    int end = tr->render_size;
+    // destination columns [d0, d1), the ones in the bytes [first, last) are
+    // moved a byte at a time and the ones at either end one at a time
+    int d0 = from + by;
+    int d1 = end + by;
+    int first = (d0 + 1) / 2;
+    int last = d1 / 2;
+    int b;
+
+    if (d0 >= d1) {
+        return;
+    }
+
+    if (by > 0 && d1 % 2) {
+        text_row_set_hl(tr, d1 - 1, text_row_hl(tr, end - 1));
+    } else if (by < 0 && d0 % 2) {
+        text_row_set_hl(tr, d0, text_row_hl(tr, from));
+    }
+
+    if (first < last && by % 2 == 0) {
+        memmove(&hl[first], &hl[first - by / 2], last - first);
+    } else if (first < last) {
+        // an odd shift puts the high half of one byte and the low half of
+        // the next one together
+        int c = (by + 1) / 2;
+        if (by > 0) {
+            for (b = last - 1; b >= first; b--) {
+                hl[b] = (hl[b - c] >> 4) | (hl[b - c + 1] << 4);
+            }
+        } else {
+            for (b = first; b < last; b++) {
+                hl[b] = (hl[b - c] >> 4) | (hl[b - c + 1] << 4);
+            }
+        }
+    }
+
+    if (by > 0 && d0 % 2) {
+        text_row_set_hl(tr, d0, text_row_hl(tr, from));
+    } else if (by < 0 && d1 % 2) {
+        text_row_set_hl(tr, d1 - 1, text_row_hl(tr, end - 1));
+    }
+}
+
+/**
+ * Checks whether the content of the row holds a tab in [from, to).
+ */
+static int text_row_has_tab(text_row *tr, int from, int to)
+{
+    int end = to < tr->gap_start ? to : tr->gap_start;
+
+    if (from < end && memchr(&tr->content[from], '\t', end - from)) {
+        return 1;
+    }
+
+    int start = from > tr->gap_start ? from : tr->gap_start;
+
+    return start < to &&
+           memchr(&tr->content[start + tr->gap_len], '\t', to - start);
+}
+
+/**
+ * Returns the render column following the character c, which starts at column
+ * rx.
+ */
+static int next_rx(int rx, char c)
+{
+    if (c == '\t') {
+        return rx + TAB_STOP - (rx % TAB_STOP);
+    } else if (iscntrl(c)) {
+        return rx + 2;
+    }
+
+    return rx + 1;
+}
+
+/**
+ * Returns the column index of the row, brought up to date for the characters
+ * up to position upto, or NULL if the row is short enough to walk instead.
+ */
+static column_index *text_row_columns(text_row *tr, int upto)
+{
+    if (tr->size <= COLUMN_STEP) {
+        return NULL;
+    }
+
+    column_index *ci = tr->columns;
+    int need = tr->size / COLUMN_STEP + 1;
+
+    if (!ci || ci->cap < need) {
+        int cap = ci && ci->cap * 2 > need ? ci->cap * 2 : need;
+        int len = ci ? ci->len : 0;
+
+        ci = slab_realloc(&ec.doc.mem, ci,
+                          ci ? COLUMN_INDEX_BYTES(ci->cap) : 0,
+                          COLUMN_INDEX_BYTES(cap), COLUMN_INDEX_BYTES(len));
+        ci->cap = cap;
+        ci->len = len;
+        tr->columns = ci;
+    }
+
+    if (ci->len == 0) {
+        ci->at[0].rx = 0;
+        ci->at[0].idx = 0;
+        ci->len = 1;
+    }
+
+    int last = upto / COLUMN_STEP;
+
+    if (last >= need) {
+        last = need - 1;
+    }
+
+    while (ci->len <= last) {
+        int from = (ci->len - 1) * COLUMN_STEP;
+        int rx = ci->at[ci->len - 1].rx;
+        int idx = ci->at[ci->len - 1].idx;
+        int i;
+
+        for (i = from; i < from + COLUMN_STEP; i++) {
+            char c = text_row_char(tr, i);
+            rx = next_rx(rx, c);
+            idx = c == '\t' ? idx + TAB_STOP - (idx % TAB_STOP) : idx + 1;
+        }
+        ci->at[ci->len].rx = rx;
+        ci->at[ci->len].idx = idx;
+        ci->len++;
+    }
+
+    return ci;
+}
+
+static int column_value(column const *c, int rx)
+{
+    return rx ? c->rx : c->idx;
+}
+
+/**
+ * Returns the last entry of the column index of a long row that is not past
+ * column col, on screen if rx is set and in the render otherwise. The index
+ * is brought up to date as far as needed.
+ */
+static int text_row_find_column(text_row *tr, int col, int rx)
+{
+    column_index *ci = text_row_columns(tr, 0);
+    int need = tr->size / COLUMN_STEP + 1;
+
+    while (ci->len < need && column_value(&ci->at[ci->len - 1], rx) <= col) {
+        text_row_columns(tr, ci->len * COLUMN_STEP);
+    }
+
+    int lo = 0;
+    int hi = ci->len - 1;
+
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (column_value(&ci->at[mid], rx) <= col) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * Renders and highlights a long row around the columns on screen only, a few
+ * steps of its column index on either side. The tokenizer starts afresh at
+ * the window, and the row is taken to neither start nor end a multiline
+ * comment, as finding out would mean going through all of it.
+ */
+static void text_row_render_window(text_row *tr, int open_comment)
+{
+    int k = text_row_find_column(tr, ec.col_offset, 0);
+    int first = k > 0 ? k - 1 : 0;
+    int from = first * COLUMN_STEP;
+    int to = (k + 2 + ec.cols / COLUMN_STEP) * COLUMN_STEP;
+    int idx = tr->columns->at[first].idx;
+    int tabs = 0;
+    int i;
+
+    if (to > tr->size) {
+        to = tr->size;
+    }
+
+    for (i = from; i < to; i++) {
+        if (text_row_char(tr, i) == '\t') {
+            tabs++;
+        }
+    }
+
+    int cap = to - from + tabs * (TAB_STOP - 1) + 1;
+    char *block = slab_alloc(&ec.doc.mem, cap + HL_BYTES(cap));
+    char *p = block;
+
+    text_row_drop_render(tr);
+    tr->to_render = block;
+    tr->highlight = (unsigned char *)&block[cap];
+    tr->render_cap = cap;
+    tr->render_start = idx;
+    tr->flags |= ROW_WINDOW;
+
+    for (i = from; i < to; i++) {
+        char c = text_row_char(tr, i);
+        if (c == '\t') {
+            do {
+                *p++ = ' ';
+                idx++;
+            } while (idx % TAB_STOP != 0);
+        } else {
+            *p++ = c;
+            idx++;
+        }
+    }
+
+    *p = '\0';
+    tr->render_size = idx;
+
+    update_syntax(tr, open_comment);
+    tr->highlight_open_comment = open_comment;
+}
+
+/**
+ * Returns the index in the render of the character at position pos.
+ */
+static int text_row_render_index(text_row *tr, int pos)
+{
+    if (!text_row_has_tab(tr, 0, pos)) {
+        return pos;
+    }
+
+    column_index *ci = text_row_columns(tr, pos);
+    int idx = 0;
+    int i = 0;
+
+    if (ci) {
+        i = pos / COLUMN_STEP * COLUMN_STEP;
+        idx = ci->at[pos / COLUMN_STEP].idx;
+    }
+
+    for (; i < pos; i++) {
+        if (text_row_char(tr, i) == '\t') {
+            idx += (TAB_STOP - 1) - (idx % TAB_STOP);
+        }
+        idx++;
+    }
+
+    return idx;
+}
+
+/**
+ * Renders the content of the row from character pos onwards, which lands at
+ * index idx of the render.
+ */
+static void text_row_render_from(text_row *tr, int pos, int idx)
+{
+    if (!text_row_has_tab(tr, 0, tr->size)) {
+        text_row_reserve_render(tr, tr->size, 0);
+        tr->render_size = tr->size;
+        return;
+    }
+
+    if (!tr->to_render) {
+        // the render so far was the content itself
+        pos = 0;
+        idx = 0;
+    }
+
+    int tabs = 0;
+    int i;
+
+    for (i = pos; i < tr->size; i++) {
+        if (text_row_char(tr, i) == '\t') {
+            tabs++;
+        }
+    }
+
+    text_row_reserve_render(tr, idx + tr->size - pos + tabs * (TAB_STOP - 1),
+                            1);
+
+    for (i = pos; i < tr->size; i++) {
+        char c = text_row_char(tr, i);
+        if (c == '\t') {
+            tr->to_render[idx++] = ' ';
+            while (idx % TAB_STOP != 0) {
+                tr->to_render[idx++] = ' ';
+            }
+        } else {
+            tr->to_render[idx++] = c;
+        }
+    }
+
+    tr->to_render[idx] = '\0';
+    tr->render_size = idx;
+}
+
+/**
+ * Highlights the row to find out whether it ends inside a multiline comment,
+ * a row without a render only gets one for the time being.
+ */
+static int highlight_through(text_row *tr, int open_comment)
+{
+    if (tr->size > LONG_ROW_SIZE) {
+        // the window gets highlighted again once shown
+        text_row_drop_render(tr);
+        tr->highlight_open_comment = open_comment;
+        return open_comment;
+    }
+
+    if (tr->highlight) {
+        return update_syntax(tr, open_comment);
+    }
+
+    text_row_render_from(tr, 0, 0);
+    open_comment = update_syntax(tr, open_comment);
+    text_row_drop_render(tr);
+
+    return open_comment;
+}
+
+/**
+ * Returns whether the rows in [from, to) can be highlighted right away: there
+ * are few enough of them, or the highlight worker went over them already.
+ */
+static int can_highlight(int from, int to)
+{
+    return to - from <= HIGHLIGHT_SLICE ||
+           (job_states && from >= job_first && to <= job_first + job_n);
+}
+
+/**
+ * Keeps the state the row before position at ends with if at is the next
+ * checkpoint, when the file is only viewed.
+ */
+static void keep_checkpoint(int at, int open_comment)
+{
+    if (!ec.read_only || at % HIGHLIGHT_SLICE ||
+        at / HIGHLIGHT_SLICE != num_checkpoints + 1) {
+        return;
+    }
+
+    if (num_checkpoints == checkpoints_cap) {
+        checkpoints_cap = checkpoints_cap ? checkpoints_cap * 2 : 64;
+        checkpoints = realloc(checkpoints, checkpoints_cap);
+        if (!checkpoints) {
+            DIE("Failed to allocate memory");
+        }
+    }
+
+    checkpoints[num_checkpoints++] = open_comment;
+}
+
+/**
+ * Highlights the row at position at like highlight_through, unless it needs no
+ * highlight of its own and the highlight worker went over it following the
+ * same state: the state it ends with is then taken from the worker.
+ */
+static int highlight_row_at(text_row *tr, int at, int open_comment)
+{
+    int i = at - job_first;
+
+    if (job_states && !tr->highlight && i >= 0 && i < job_n &&
+        open_comment == (i ? job_states[i - 1] : job_open_comment)) {
+        tr->highlight_open_comment = open_comment = job_states[i];
+    } else {
+        open_comment = highlight_through(tr, open_comment);
+    }
+
+    keep_checkpoint(at + 1, open_comment);
+    return open_comment;
+}
+
+/**
+ * Wants the highlight worker to go over the rows up to position at, returns
+ * -1 for the state of the row before it not being known yet.
+ */
+static int want_highlight(int at)
+{
+    if (at > highlight_wanted) {
+        highlight_wanted = at;
+    }
+
+    return -1;
+}
+
+/**
+ * Returns whether the row before position at ends inside a multiline comment,
+ * or -1 if that is not known yet. Rows above it that were never highlighted
+ * get highlighted on the way, unless there are too many of them: the rows up
+ * to it are then wanted from the highlight worker. The rows left for later by
+ * an edit are not looked at.
+ */
+static int highlight_unknown_before(int at)
+{
+    if (at == 0 || ec.syntax == NULL) {
+        return 0;
+    }
+
+    // no further back than the nearest checkpoint
+    int k = at / HIGHLIGHT_SLICE;
+
+    if (k > num_checkpoints) {
+        k = num_checkpoints;
+    }
+
+    int base = k * HIGHLIGHT_SLICE;
+    int from = at - 1;
+
+    while (from >= base) {
+        if (doc_get(&ec.doc, from)->highlight_open_comment >= 0) {
+            break;
+        }
+        if (!can_highlight(from, at)) {
+            return want_highlight(at);
+        }
+        from--;
+    }
+
+    int open_comment;
+
+    if (from >= base) {
+        open_comment = doc_get(&ec.doc, from)->highlight_open_comment;
+        from++;
+    } else {
+        open_comment = k ? checkpoints[k - 1] : 0;
+        from = base;
+    }
+
+    for (; from < at; from++) {
+        open_comment =
+            highlight_row_at(doc_get(&ec.doc, from), from, open_comment);
+    }
+
+    if (at > highlighted_to) {
+        highlighted_to = at;
+    }
+
+    return open_comment;
+}
+
+/**
+ * Highlights the rows left for later before position to, for as long as the
+ * multiline comment state they end with differs from the one they were
+ * highlighted with. The rows from to on are left for later again, and so are
+ * all of them when too far from to or following rows not highlighted yet.
+ */
+static void highlight_pending_until(int to)
+{
+    if (pending_from < 0 || pending_from >= to ||
+        !can_highlight(pending_from, to)) {
+        return;
+    }
 
-    // select syntax highlighting based on file type
-    select_syntax_highlight();
+    int at = pending_from;
+    int open_comment = highlight_unknown_before(at);
 
-    FILE *fp = fopen(filename, "r");
+    if (open_comment < 0) {
+        return;
+    }
 
-    if (!fp) {
-        DIE("Failed to open file");
+    pending_from = -1;
+
+    for (; at < ec.num_trows; at++) {
+        text_row *tr = doc_get(&ec.doc, at);
+        int was_open = tr->highlight_open_comment;
+
+        // rows never highlighted are once they get shown, unless rows below
+        // them were edited too
+        if (was_open < 0 && at >= pending_to) {
+            return;
+        }
+
+        if (at == to) {
+            pending_from = at;
+            if (pending_to < at) {
+                pending_to = at;
+            }
+            return;
+        }
+
+        open_comment = highlight_row_at(tr, at, open_comment);
+        if (open_comment == was_open && at >= pending_to) {
+            return;
+        }
     }
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t line_len;
+/**
+ * Returns whether the row before position at ends inside a multiline comment,
+ * highlighting the rows above it that were left for later or never
+ * highlighted, or -1 if there are too many of them to do it right away.
+ */
+static int open_comment_before(int at)
+{
+    highlight_pending_until(at);
 
-    while ((line_len = getline(&line, &linecap, fp)) != -1) {
-        while (line_len > 0 &&
-               (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
-            line_len--;
+    // the row is to be highlighted again along with the rows above it
+    if (pending_from >= 0 && pending_from < at) {
+        if (pending_to <= at) {
+            pending_to = at + 1;
         }
-        insert_text_row(ec.num_trows, line, line_len);
+        return -1;
     }
-    FREE(line);
-    fclose(fp);
-    ec.dirty = 0;
+
+    return highlight_unknown_before(at);
 }
 
-void insert_text_row(int pos, char *content, size_t len)
+/**
+ * Highlights the rows from position at on, for as long as the multiline
+ * comment state they end with differs from the one they were highlighted
+ * with. Only the rows up to the bottom of the screen get highlighted right
+ * away, the rest is left for later: for when they are shown, or for the
+ * highlight worker.
+ */
+static void update_syntax_from(int at)
 {
-    if (pos < 0 || pos > ec.num_trows)
+    if (at >= ec.num_trows) {
+        return;
+    }
+
+    if (pending_from < 0) {
+        pending_from = pending_to = at;
+    } else if (at < pending_from) {
+        pending_from = at;
+    } else if (at > pending_to) {
+        pending_to = at;
+    }
+
+    highlight_pending_until(ec.row_offset + ec.rows);
+}
+
+/**
+ * Drops what the highlight worker works out for the rows from position at on,
+ * the row there having changed or rows having been inserted or removed there.
+ */
+static void cancel_highlight_from(int at)
+{
+    if (job_n && at < job_first + job_n) {
+        highlight_worker_cancel();
+        job_n = 0;
+    }
+}
+
+/**
+ * Moves the rows left for later along with n rows inserted at position at, or
+ * with the row removed from there if n is -1.
+ */
+static void shift_pending(int at, int n)
+{
+    cancel_highlight_from(at);
+
+    if (highlighted_to > at) {
+        highlighted_to += n;
+    }
+
+    if (pending_from < 0) {
+        return;
+    }
+
+    // the last row went away with nothing below it left to highlight
+    if (n < 0 && pending_from == at && at == ec.num_trows - 1) {
+        pending_from = -1;
+        return;
+    }
+
+    if (pending_from > at || (n > 0 && pending_from == at)) {
+        pending_from += n;
+    }
+
+    if (pending_to > at || (n > 0 && pending_to == at)) {
+        pending_to += n;
+    }
+}
+
+/**
+ * Hands the highlight worker the next rows to go over: those an edit left for
+ * later, or the rows up to the one wanted when too far from the rows known.
+ */
+static void post_highlight(void)
+{
+    if (ec.syntax == NULL) {
+        return;
+    }
+
+    int first = pending_from;
+    int open_comment = first >= 0 ? highlight_unknown_before(first) : -1;
+
+    job_pending = open_comment >= 0;
+
+    if (!job_pending) {
+        if (highlight_wanted < 0) {
+            return;
+        }
+
+        // rows stay highlighted when the file gets edited, they may not when
+        // it is only viewed but the checkpoints do
+        if (ec.read_only) {
+            first = num_checkpoints * HIGHLIGHT_SLICE;
+            open_comment = num_checkpoints ? checkpoints[num_checkpoints - 1]
+                                           : 0;
+        } else {
+            first = highlighted_to;
+            open_comment = highlight_unknown_before(first);
+            if (open_comment < 0) {
+                first = highlighted_to = 0;
+                open_comment = 0;
+            }
+        }
+
+        if (first >= highlight_wanted) {
+            highlight_wanted = -1;
+            return;
+        }
+    }
+
+    int n = ec.num_trows - first;
+
+    if (n > HIGHLIGHT_BATCH) {
+        n = HIGHLIGHT_BATCH;
+    }
+
+    if (n <= 0) {
+        highlight_wanted = -1;
         return;
+    }
+
+    job_first = first;
+    job_n = n;
+    job_open_comment = open_comment;
+    highlight_worker_post(first, n, open_comment);
+}
+
+int highlight_poll(void)
+{
+    unsigned char const *states = highlight_worker_take();
+    int highlighted = 0;
+
+    if (states && job_n) {
+        int i;
 
-    ec.t_rows = realloc(ec.t_rows, sizeof(text_row) * (ec.num_trows + 1));
+        job_states = states;
+
+        if (job_pending) {
+            highlight_pending_until(job_first + job_n);
+        } else if (ec.read_only) {
+            for (i = 0; i < job_n; i++) {
+                keep_checkpoint(job_first + i + 1, states[i]);
+            }
+        } else {
+            open_comment_before(job_first + job_n);
+        }
 
-    memmove(&ec.t_rows[pos + 1], &ec.t_rows[pos],
-            sizeof(text_row) * (ec.num_trows - pos));
+        job_states = NULL;
+        highlighted = 1;
+    }
 
-    for (int i = pos + 1; i <= ec.num_trows; ++i) {
-        ec.t_rows[i].index++;
+    if (!highlight_worker_busy()) {
+        job_n = 0;
+        post_highlight();
     }
 
-    ec.t_rows[pos].index = pos;
-    ec.t_rows[pos].size = len;
-    ec.t_rows[pos].content = malloc(len + 1);
-    memcpy(ec.t_rows[pos].content, content, len);
-    ec.t_rows[pos].content[len] = '\0';
-    ec.t_rows[pos].render_size = 0;
-    ec.t_rows[pos].to_render = NULL;
-    ec.t_rows[pos].highlight = NULL;
-    ec.t_rows[pos].highlight_open_comment = 0;
+    return highlighted;
+}
+
+/**
+ * Sets up a new row holding a copy of the given content, neither rendered nor
+ * highlighted yet.
+ */
+static void text_row_init(text_row *tr, char const *content, size_t len)
+{
+    int cap = slab_size(len + 1);
+
+    tr->flags = 0;
+    tr->size = len;
+    tr->content = slab_alloc(&ec.doc.mem, cap);
+    memcpy(tr->content, content, len);
+    tr->gap_start = len;
+    tr->gap_len = cap - len;
+    tr->render_size = 0;
+    tr->render_cap = 0;
+    tr->to_render = NULL;
+    tr->highlight = NULL;
+    tr->highlight_open_comment = -1;
+    tr->render_start = 0;
+    tr->columns = NULL;
+    tr->width = 0;
+}
+
+void insert_text_row(int pos, char *content, size_t len)
+{
+    if (pos < 0 || pos > ec.num_trows)
+        return;
+
+    // the rows below were highlighted as following the previous row, they
+    // only need to be highlighted again if this one ends differently. Asked
+    // before the row goes in, for the rows above not to stop at it
+    int open_comment = open_comment_before(pos);
+    text_row *tr = doc_insert(&ec.doc, pos, len);
 
-    update_text_row(&ec.t_rows[pos]);
+    text_row_init(tr, content, len);
+    shift_pending(pos, 1);
+    tr->highlight_open_comment = open_comment;
 
     ec.num_trows++;
+    update_text_row(tr, pos);
+
     ec.dirty++;
 }
 
@@ -136,62 +1189,166 @@ void delete_text_row(int pos)
     if (pos < 0 || pos >= ec.num_trows)
         return;
 
-    free_text_row(&ec.t_rows[pos]);
+    text_row *tr = doc_get(&ec.doc, pos);
+    int open_comment = tr->highlight_open_comment;
 
-    memmove(&ec.t_rows[pos], &ec.t_rows[pos + 1],
-            sizeof(text_row) * (ec.num_trows - pos - 1));
-
-    for (int i = pos; i < ec.num_trows - 1; ++i) {
-        ec.t_rows[i].index--;
-    }
+    free_text_row(tr);
+    doc_remove(&ec.doc, pos);
+    shift_pending(pos, -1);
 
     ec.num_trows--;
     ec.dirty++;
+
+    // the row now at pos was highlighted as following the deleted one
+    if (open_comment >= 0 && open_comment != open_comment_before(pos)) {
+        update_syntax_from(pos);
+    }
 }
 
-void free_text_row(text_row *tr)
+char const *text_row_text(text_row *tr)
 {
-    FREE(tr->content);
-    FREE(tr->to_render);
-    FREE(tr->highlight);
+    text_row_move_gap(tr, tr->size);
+    return tr->content;
 }
 
-void update_text_row(text_row *row)
+/**
+ * Hands the width of the row at position at to the document once it is
+ * rendered in full, for the screen lines it takes when wrapped. Long rows
+ * are not wrapped.
+ */
+static void text_row_measure(text_row *tr, int at)
 {
-    int tabs = 0;
-    int i;
+    int width = tr->size > LONG_ROW_SIZE ? 0 : tr->render_size;
 
-    for (i = 0; i < row->size; i++) {
-        if (row->content[i] == '\t') {
-            tabs++;
+    if (width != tr->width) {
+        doc_set_width(&ec.doc, at, width);
+    }
+}
+
+/**
+ * Returns whether the row before position at ends inside a multiline comment
+ * like open_comment_before, the row at position at having been highlighted
+ * along with the rows below it if highlighting the rows above left it for
+ * later: it is not to be highlighted on its own then.
+ */
+static int open_comment_at(int at)
+{
+    int open_comment = open_comment_before(at);
+
+    highlight_pending_until(at + 1);
+    return open_comment;
+}
+
+text_row *render_row(int at)
+{
+    // the row itself may have been left for later
+    highlight_pending_until(at + 1);
+
+    text_row *tr = doc_get(&ec.doc, at);
+    // rows it follows are not highlighted yet, it is shown plain until they are
+    int plain = tr->highlight_open_comment < 0 ||
+                (pending_from >= 0 && pending_from <= at);
+
+    if (tr->size > LONG_ROW_SIZE) {
+        if (!tr->highlight || plain || tr->render_start > ec.col_offset ||
+            tr->render_size < ec.col_offset + ec.cols) {
+            text_row_render_window(tr, open_comment_at(at));
         }
+        text_row_measure(tr, at);
+        return tr;
     }
 
-    int new_size = row->size + tabs * (TAB_STOP - 1) + 1;
-    FREE(row->to_render);
-    row->to_render = malloc(new_size);
+    if (!tr->highlight || plain) {
+        int open_comment = open_comment_at(at);
+        if (!tr->highlight) {
+            text_row_render_from(tr, 0, 0);
+        }
+        update_syntax(tr, open_comment);
+    }
 
-    if (!row->to_render) {
-        DIE("Failed to allocate memory");
+    text_row_measure(tr, at);
+    return tr;
+}
+
+void update_text_row(text_row *row, int at)
+{
+    cancel_highlight_from(at);
+    text_row_forget_columns(row, 0);
+
+    if (row->size > LONG_ROW_SIZE) {
+        text_row_drop_render(row);
+    } else {
+        text_row_render_from(row, 0, 0);
     }
 
-    int idx = 0;
-    for (i = 0; i < row->size; i++) {
-        if (row->content[i] == '\t') {
-            row->to_render[idx++] = ' ';
-            while (idx % TAB_STOP != 0) {
-                row->to_render[idx++] = ' ';
-            }
+    text_row_measure(row, at);
+
+    // update syntax for highliting
+    update_syntax_from(at);
+}
+
+/**
+ * Brings the render and the highlight of the row up to date after len
+ * characters got inserted at position pos of its content, or -len characters
+ * got removed from there. Only the edited span is rendered again unless tabs
+ * are involved, as a tab's width depends on the column it starts at.
+ */
+static void update_text_row_span(text_row *tr, int at, int pos, int len,
+                                 int tabs)
+{
+    cancel_highlight_from(at);
+    text_row_forget_columns(tr, pos);
+
+    // long rows get a new window once shown, a row that is no longer one
+    // gets all of its render back
+    if (tr->size > LONG_ROW_SIZE || (tr->flags & ROW_WINDOW)) {
+        text_row_drop_render(tr);
+        if (tr->size <= LONG_ROW_SIZE) {
+            update_text_row(tr, at);
         } else {
-            row->to_render[idx++] = row->content[i];
+            text_row_measure(tr, at);
         }
+        return;
     }
 
-    row->to_render[idx] = '\0';
-    row->render_size = idx;
+    int idx = text_row_render_index(tr, pos);
+    int to = idx;
+    int open_comment = tr->highlight_open_comment;
 
-    // update syntax for highliting
-    update_syntax(row);
+    if (tabs || text_row_has_tab(tr, len > 0 ? pos + len : pos, tr->size)) {
+        text_row_render_from(tr, pos, idx);
+        to = tr->render_size;
+    } else if (len > 0) {
+        text_row_reserve_render(tr, tr->render_size + len, !!tr->to_render);
+        text_row_shift_hl(tr, idx, len);
+
+        if (tr->to_render) {
+            memmove(&tr->to_render[idx + len], &tr->to_render[idx],
+                    tr->render_size - idx + 1);
+
+            int i;
+            for (i = 0; i < len; i++) {
+                tr->to_render[idx + i] = text_row_char(tr, pos + i);
+            }
+        }
+        tr->render_size += len;
+        to = idx + len;
+    } else {
+        text_row_shift_hl(tr, idx - len, len);
+
+        if (tr->to_render) {
+            memmove(&tr->to_render[idx], &tr->to_render[idx - len],
+                    tr->render_size - idx + len + 1);
+        }
+        tr->render_size += len;
+    }
+
+    text_row_measure(tr, at);
+
+    if (update_syntax_span(tr, open_comment_before(at), idx, to) !=
+        open_comment) {
+        update_syntax_from(at + 1);
+    }
 }
 
 void draw_line_number(abuf *buf, int line_number)
@@ -211,88 +1368,161 @@ void draw_line_number(abuf *buf, int line_number)
     buf_append(buf, " ", 1);
 }
 
-void draw_row_tildes(abuf *buf)
+/**
+ * Appends the characters in [from, to) of the row's render.
+ */
+static void append_render(abuf *buf, text_row *tr, int from, int to)
 {
-    int i;
-    for (i = 0; i < ec.rows; i++) {
-        int file_row = i + ec.row_offset;
-        if (ec.num_trows > file_row) {
-            draw_line_number(buf, file_row + 1);
-            int len = ec.t_rows[file_row].render_size - ec.col_offset;
-            if (len < 0) {
-                len = 0;
+    if (tr->to_render) {
+        buf_append(buf, &tr->to_render[from - tr->render_start], to - from);
+        return;
+    }
+
+    // plain rows render straight from their content, on either side of the
+    // gap
+    if (from < tr->gap_start) {
+        int end = to < tr->gap_start ? to : tr->gap_start;
+        buf_append(buf, &tr->content[from], end - from);
+        from = end;
+    }
+    if (from < to) {
+        buf_append(buf, &tr->content[from + tr->gap_len], to - from);
+    }
+}
+
+/**
+ * Returns the first line on screen: a row, or a screen line of the rows once
+ * they are wrapped.
+ */
+static long screen_top(void)
+{
+    if (!ec.wrap) {
+        return ec.row_offset;
+    }
+
+    return doc_line(&ec.doc, ec.row_offset) + ec.wrap_offset;
+}
+
+/**
+ * Draws len columns of the row's render from column from on, in the colors
+ * of their highlight.
+ */
+static void draw_render(abuf *buf, text_row *tr, int from, int len)
+{
+    int current_color = -1;
+    char const *current_sgr = NULL;
+    int j = 0;
+    while (j < len) {
+        char c = text_row_render_char(tr, from + j);
+        int hl = text_row_hl(tr, from + j);
+        if (iscntrl(c)) { // non printable characters
+            // non alphabetic control characters are printed as '?'
+            char symbol = '?';
+            if (c <= 26) {
+                // if it is an alphabetic control character we print the
+                // related capital letter (A..Z) which comes after the
+                // '@' character in ASCII
+                symbol = '@' + c;
             }
-            if (len > ec.cols) {
-                len = ec.cols;
+            // switch to dark grey foreground
+            buf_append(buf, "\x1b[90m", 5);
+            buf_append(buf, "^", 1);
+            buf_append(buf, &symbol, 1);
+            // switch back to default foreground
+            buf_append(buf, "\x1b[m", 3);
+            if (current_sgr) {
+                buf_append(buf, current_sgr, strlen(current_sgr));
             }
+            j++;
+            continue;
+        }
 
-            char *line = &ec.t_rows[file_row].to_render[ec.col_offset];
-            unsigned char *hl = &ec.t_rows[file_row].highlight[ec.col_offset];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(line[j])) { // non printable characters
-                    // non alphabetic control characters are printed as '?'
-                    char symbol = '?';
-                    if (line[j] <= 26) {
-                        // if it is an alphabetic control character we print the
-                        // related capital letter (A..Z) which comes after the
-                        // '@' character in ASCII
-                        symbol = '@' + line[j];
-                    }
-                    // switch to dark grey foreground
-                    buf_append(buf, "\x1b[90m", 5);
-                    buf_append(buf, "^", 1);
-                    buf_append(buf, &symbol, 1);
-                    // switch back to default foreground
-                    buf_append(buf, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char b[16];
-                        int clen =
-                            snprintf(b, sizeof(b), "\x1b[%dm", current_color);
-                        buf_append(buf, b, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        buf_append(buf, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    buf_append(buf, &line[j], 1);
-                } else {
-                    int color = syntax_to_color(hl[j]);
-                    if (color != current_color) {
-                        current_color = color;
-                        char b[16];
-                        int clen = snprintf(b, sizeof(b), "\x1b[%dm", color);
-                        buf_append(buf, b, clen);
-                    }
-                    buf_append(buf, &line[j], 1);
-                }
+        if (hl == HL_NORMAL) {
+            if (current_color != -1) {
+                buf_append(buf, "\x1b[39m", 5);
+                current_color = -1;
+                current_sgr = NULL;
+            }
+        } else {
+            int color = syntax_to_color(hl);
+            if (color != current_color) {
+                current_color = color;
+                current_sgr = syntax_to_sgr(hl);
+                buf_append(buf, current_sgr, strlen(current_sgr));
             }
-            buf_append(buf, "\x1b[39m", 5);
+        }
+
+        // the printable characters of the same class that follow are
+        // drawn along with this one
+        int end = j + 1;
+        while (end < len && text_row_hl(tr, from + end) == hl &&
+               !iscntrl(text_row_render_char(tr, from + end))) {
+            end++;
+        }
+        append_render(buf, tr, from + j, from + end);
+        j = end;
+    }
+    buf_append(buf, "\x1b[39m", 5);
+}
+
+void draw_row(abuf *buf, int i)
+{
+    int file_row = i + ec.row_offset;
+    int from = ec.col_offset;
+    // the line number takes part of the line
+    int width = ec.cols - ec.line_number_padding;
+    long line = 0;
+
+    if (ec.wrap) {
+        line = screen_top() + i;
+        file_row = line < doc_line(&ec.doc, ec.num_trows)
+                       ? doc_find_line(&ec.doc, &line)
+                       : ec.num_trows;
+    }
+
+    if (ec.num_trows > file_row) {
+        if (line == 0) {
+            draw_line_number(buf, file_row + 1);
         } else {
-            buf_append(buf, "~", 1);
-            if (ec.num_trows == 0 && i == ec.rows / 3) {
-                char welcome[30];
-                int welcome_len =
-                    snprintf(welcome, sizeof(welcome), " %s - Version %s",
-                             EDITOR_NAME, EDITOR_VERSION);
-                int padding = (ec.cols - welcome_len - 1) / 2;
-
-                while (padding > 0) {
-                    buf_append(buf, " ", 1);
-                    padding--;
-                }
-
-                buf_append(buf, welcome, welcome_len);
+            // the lines a row wraps onto go without a number
+            int padding = ec.line_number_padding;
+            while (padding > 0) {
+                buf_append(buf, " ", 1);
+                padding--;
             }
         }
 
-        // erase from the active position to the end of line.
-        // default param 0
-        buf_append(buf, "\x1b[K", 3);
+        text_row *tr = render_row(file_row);
+
+        if (ec.wrap && tr->size <= LONG_ROW_SIZE) {
+            from = line * width;
+        }
+
+        int len = tr->render_size - from;
+        if (len < 0) {
+            len = 0;
+        }
+        if (len > width) {
+            len = width;
+        }
+
+        draw_render(buf, tr, from, len);
+    } else {
+        buf_append(buf, "~", 1);
+        if (ec.num_trows == 0 && i == ec.rows / 3) {
+            char welcome[30];
+            int welcome_len =
+                snprintf(welcome, sizeof(welcome), " %s - Version %s",
+                         EDITOR_NAME, EDITOR_VERSION);
+            int padding = (ec.cols - welcome_len - 1) / 2;
+
+            while (padding > 0) {
+                buf_append(buf, " ", 1);
+                padding--;
+            }
 
-        buf_append(buf, "\r\n", 2);
+            buf_append(buf, welcome, welcome_len);
+        }
     }
 }
 
@@ -302,16 +1532,19 @@ void draw_row_tildes(abuf *buf)
  */
 int row_cx_to_rx(text_row *tr, int cx)
 {
+    column_index *ci = text_row_columns(tr, cx);
+    int i = 0;
     int rx = 0;
-    int i;
 
-    for (i = 0; i < cx; i++) {
-        if (tr->content[i] == '\t') {
-            rx += (TAB_STOP - 1) - (rx % TAB_STOP);
-        } else if (iscntrl(tr->content[i])) {
-            rx++;
-        }
-        rx++;
+    // long rows are only walked from the closest column known before cx
+    if (ci) {
+        int k = cx / COLUMN_STEP < ci->len ? cx / COLUMN_STEP : ci->len - 1;
+        i = k * COLUMN_STEP;
+        rx = ci->at[k].rx;
+    }
+
+    for (; i < cx; i++) {
+        rx = next_rx(rx, text_row_char(tr, i));
     }
 
     return rx;
@@ -324,16 +1557,17 @@ int row_cx_to_rx(text_row *tr, int cx)
 int row_rx_to_cx(text_row *tr, int rx)
 {
     int curr_rx = 0;
-    int i;
+    int i = 0;
 
-    for (i = 0; i < tr->size; i++) {
-        if (tr->content[i] == '\t') {
-            curr_rx += (TAB_STOP - 1) - (curr_rx % TAB_STOP);
-        } else if (iscntrl(tr->content[i])) {
-            curr_rx++;
-        }
+    // walking starts from the last known column not past rx
+    if (tr->size > COLUMN_STEP) {
+        int k = text_row_find_column(tr, rx, 1);
+        i = k * COLUMN_STEP;
+        curr_rx = tr->columns->at[k].rx;
+    }
 
-        curr_rx++;
+    for (; i < tr->size; i++) {
+        curr_rx = next_rx(curr_rx, text_row_char(tr, i));
 
         if (curr_rx > rx) {
             // Example: [\t][a][b] would be rendered as [........][a][b]
@@ -346,76 +1580,178 @@ int row_rx_to_cx(text_row *tr, int rx)
         }
     }
 
-    return i;
+    return i;
+}
+
+int row_rx_to_line(text_row *tr, int rx)
+{
+    if (!ec.doc.wrap) {
+        return 0;
+    }
+
+    int line = rx / ec.doc.wrap;
+    int lines = doc_row_lines(&ec.doc, tr);
+
+    // the end of a row that fills its last line is on that line
+    return line < lines ? line : lines - 1;
+}
+
+/**
+ * Keeps the cursor on screen by screen lines of the wrapped rows, the screen
+ * starting at line wrap_offset of the row at row_offset.
+ */
+static void scroll_wrapped(void)
+{
+    int width = ec.cols - ec.line_number_padding;
+
+    if (ec.doc.wrap != width) {
+        doc_wrap(&ec.doc, width);
+    }
+
+    // the rows that can share the screen with the cursor get measured first,
+    // so none of them wraps once drawn and pushes it off the screen
+    int at = ec.row_offset < ec.cy ? ec.row_offset : ec.cy;
+    if (at < ec.cy - ec.rows + 1) {
+        at = ec.cy - ec.rows + 1;
+    }
+    for (; at <= ec.cy && at < ec.num_trows; at++) {
+        render_row(at);
+    }
+
+    if (ec.row_offset >= ec.num_trows) {
+        ec.row_offset = ec.num_trows;
+        ec.wrap_offset = 0;
+    } else {
+        int lines = doc_row_lines(&ec.doc, doc_get(&ec.doc, ec.row_offset));
+        if (ec.wrap_offset >= lines) {
+            ec.wrap_offset = lines - 1;
+        }
+    }
+
+    long cursor = doc_line(&ec.doc, ec.cy);
+    long top = screen_top();
+
+    if (ec.cy < ec.num_trows) {
+        cursor += row_rx_to_line(doc_get(&ec.doc, ec.cy), ec.rx);
+    }
+
+    if (cursor < top) {
+        top = cursor;
+    }
+
+    if (cursor >= top + ec.rows) {
+        top = cursor - ec.rows + 1;
+    }
+
+    ec.row_offset = doc_find_line(&ec.doc, &top);
+    ec.wrap_offset = top;
 }
 
 void scroll(void)
 {
+    if (ec.num_trows) {
+        // Two spaces padding before & after the line number
+        ec.line_number_padding = count_digits(ec.num_trows) + 2;
+        if (ec.line_number_padding < EDITOR_DEFAULT_LINE_NUMBER_PADDING) {
+            ec.line_number_padding = EDITOR_DEFAULT_LINE_NUMBER_PADDING;
+        }
+    }
+
     ec.rx = 0;
 
     if (ec.cy < ec.num_trows) {
-        ec.rx = row_cx_to_rx(&ec.t_rows[ec.cy], ec.cx);
+        ec.rx = row_cx_to_rx(doc_get(&ec.doc, ec.cy), ec.cx);
     }
 
-    if (ec.cy < ec.row_offset) {
-        ec.row_offset = ec.cy;
-    }
+    if (ec.wrap) {
+        scroll_wrapped();
+
+        // rows too long to wrap still scroll sideways
+        if (ec.cy >= ec.num_trows ||
+            doc_get(&ec.doc, ec.cy)->size <= LONG_ROW_SIZE) {
+            ec.col_offset = 0;
+            return;
+        }
+    } else {
+        if (ec.cy < ec.row_offset) {
+            ec.row_offset = ec.cy;
+        }
 
-    if (ec.cy >= ec.row_offset + ec.rows) {
-        ec.row_offset = ec.cy - ec.rows + 1;
+        if (ec.cy >= ec.row_offset + ec.rows) {
+            ec.row_offset = ec.cy - ec.rows + 1;
+        }
     }
 
     if (ec.rx < ec.col_offset) {
         ec.col_offset = ec.rx;
     }
 
-    if (ec.rx >= ec.col_offset + ec.cols) {
-        ec.col_offset = ec.rx - ec.cols + 1;
+    if (ec.rx >= ec.col_offset + ec.cols - ec.line_number_padding) {
+        ec.col_offset = ec.rx - ec.cols + ec.line_number_padding + 1;
     }
 }
 
 void refresh_screen(void)
 {
     scroll();
-    abuf buf = ABUF_INIT;
 
-    // Hide the cursor to get rid of flickering effect
-    buf_append(&buf, "\x1b[?25l", 6);
+    // only the latest state is drawn once a slow terminal took in the last
+    // frame
+    if (!screen_ready()) {
+        return;
+    }
 
-    if (ec.num_trows) {
-        // Two spaces padding before & after the line number
-        ec.line_number_padding = count_digits(ec.num_trows) + 2;
-        if (ec.line_number_padding < EDITOR_DEFAULT_LINE_NUMBER_PADDING) {
-            ec.line_number_padding = EDITOR_DEFAULT_LINE_NUMBER_PADDING;
-        }
+    // the rows of the file, then the status bar and the message bar
+    screen_begin(ec.rows + 2, ec.cols);
+
+    // the rows still shown after a vertical scroll are moved by the
+    // terminal, which leaves only the ones scrolled into view to draw
+    long top = screen_top();
+    long by = top - drawn_top;
+
+    // anything farther than a screen away is drawn in full anyway
+    if (by < -ec.rows || by > ec.rows) {
+        by = ec.rows;
     }
 
-    // Move cursor to the home position
-    buf_append(&buf, "\x1b[H", 3);
+    screen_scroll(0, ec.rows - 1, by);
+    drawn_top = top;
+
+    // drawn into again for every line of every frame
+    static abuf line = ABUF_INIT;
+
+    int i;
+    for (i = 0; i < ec.rows + 2; i++) {
+        if (i < ec.rows) {
+            draw_row(&line, i);
+        } else if (i == ec.rows) {
+            draw_status_bar(&line);
+        } else {
+            draw_message_bar(&line);
+        }
 
-    draw_row_tildes(&buf);
-    draw_status_bar(&buf);
-    draw_message_bar(&buf);
+        screen_line(i, &line);
+    }
 
     // cursor position
     int r = (ec.cy - ec.row_offset) + 1;
     int c = (ec.rx - ec.col_offset + ec.line_number_padding) + 1;
 
+    if (ec.wrap) {
+        int line = 0;
+        if (ec.cy < ec.num_trows) {
+            line = row_rx_to_line(doc_get(&ec.doc, ec.cy), ec.rx);
+        }
+        r = doc_line(&ec.doc, ec.cy) + line - top + 1;
+        c -= line * ec.doc.wrap;
+    }
+
     if (ec.prompting) {
         r = ec.rows + 2;
         c = strlen(ec.status_msg) + 1;
     }
 
-    // move cursor to position r, c
-    char move_cmd[32];
-    snprintf(move_cmd, sizeof(move_cmd), "\x1b[%d;%dH", r, c);
-    buf_append(&buf, move_cmd, strlen(move_cmd));
-
-    // Show the cursor
-    buf_append(&buf, "\x1b[?25h", 6);
-
-    write(STDOUT_FILENO, buf.buf, buf.len);
-    buf_free(&buf);
+    screen_end(r, c);
 }
 
 void disable_raw_mode(void)
@@ -424,8 +1760,13 @@ void disable_raw_mode(void)
         DIE("tcsetattr: Unable to set changed terminal settings");
     }
 
-    // switch back from alternate buffer to main screen
-    write(STDOUT_FILENO, "\x1b[?1049l", 8);
+    // the output left is written once writes wait for the terminal again
+    fcntl(STDOUT_FILENO, F_SETFL, ec.default_out_flags);
+    screen_sync();
+
+    // turn bracketed paste off and line wrapping back on, and switch back
+    // from alternate buffer to main screen
+    write(STDOUT_FILENO, "\x1b[?2004l\x1b[?7h\x1b[?1049l", 21);
 }
 
 void enable_raw_mode(void)
@@ -434,23 +1775,75 @@ void enable_raw_mode(void)
         DIE("tcgetattr: Unable to retrieve terminal settings");
     }
 
+    ec.default_out_flags = fcntl(STDOUT_FILENO, F_GETFL);
+    if (ec.default_out_flags == -1) {
+        DIE("fcntl: Unable to retrieve terminal file status flags");
+    }
+
     atexit(disable_raw_mode);
 
     struct termios raw = ec.default_settings;
     cfmakeraw(&raw);
+    // reads never wait, waiting for input is up to poll
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
         DIE("tcsetattr: Unable to set changed terminal settings");
     }
 
-    // enable alternate buffer
-    write(STDOUT_FILENO, "\x1b[?1049h", 8);
+    // enable alternate buffer, and turn off line wrapping so a line drawn
+    // too long cannot spill over the next one, which may not get redrawn.
+    // Pasted text comes bracketed to be inserted as is, at once
+    write(STDOUT_FILENO, "\x1b[?1049h\x1b[?7l\x1b[?2004h", 21);
+
+    // frames are written without waiting for a slow terminal, see
+    // screen_ready
+    if (fcntl(STDOUT_FILENO, F_SETFL, ec.default_out_flags | O_NONBLOCK) ==
+        -1) {
+        DIE("fcntl: Unable to make terminal output non-blocking");
+    }
+}
+
+/**
+ * Measures the rows in [from, to) before moving over them by screen lines,
+ * which rows wrapping only once drawn would throw off.
+ */
+static void measure_rows(int from, int to)
+{
+    if (from < 0) {
+        from = 0;
+    }
+
+    for (; from < to && from < ec.num_trows; from++) {
+        render_row(from);
+    }
+}
+
+/**
+ * Switches between wrapping the rows wider than the screen and scrolling
+ * sideways to see them.
+ */
+static void toggle_wrap(void)
+{
+    ec.wrap = !ec.wrap;
+    ec.wrap_offset = 0;
+    ec.col_offset = 0;
+
+    if (!ec.wrap) {
+        doc_wrap(&ec.doc, 0);
+    }
+
+    set_status_msg("Wrap %s", ec.wrap ? "on" : "off");
 }
 
 void process_key(void)
 {
+    // no row pointers are held while waiting for a key, let go of the rows
+    // the screen has moved away from
+    doc_trim(&ec.doc, ec.read_only ? VIEW_WINDOW_LEAVES : RENDER_CACHE_LEAVES,
+             unload_rows);
+
     int c = read_key();
 
     switch (c) {
@@ -465,21 +1858,34 @@ void process_key(void)
                 quit_times--;
                 return;
             }
+            {
+                screen_stats stats = screen_get_stats();
+                LOG(INFO, "%ld bytes written over %ld frames, %ld skipped",
+                    stats.bytes, stats.frames, stats.skipped);
+            }
             // Erase all of the display – all lines are erased, changed to
             // single-width, and the cursor does not move
-            write(STDOUT_FILENO, "\x1b[2J", 4);
+            screen_write("\x1b[2J", 4);
             // Move cursor to the home position
-            write(STDOUT_FILENO, "\x1b[H", 3);
+            screen_write("\x1b[H", 3);
+            close_file();
             exit(EXIT_SUCCESS);
             break;
         case CTRL_KEY('s'):
             save();
             break;
+        case CTRL_KEY('w'):
+            toggle_wrap();
+            break;
 
         case CTRL_KEY('f'):
             find();
             break;
 
+        case CTRL_KEY('g'):
+            go_to();
+            break;
+
         case ARROW_UP:
         case ARROW_DOWN:
         case ARROW_LEFT:
@@ -487,27 +1893,21 @@ void process_key(void)
             move_cursor(c);
             break;
         case PAGE_UP:
-            {
-                ec.cy = ec.row_offset;
-
-                int i = ec.rows;
-                while (i--) {
-                    move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-                }
+            // a screen up from the top of the screen
+            if (ec.wrap) {
+                measure_rows(ec.row_offset - ec.rows, ec.row_offset);
+                move_cursor_to_line(screen_top() - ec.rows);
+            } else {
+                move_cursor_to(ec.row_offset - ec.rows, ec.cx);
             }
             break;
         case PAGE_DOWN:
-            {
-                ec.cy = ec.row_offset + ec.rows - 1;
-
-                if (ec.cy > ec.num_trows - 1) {
-                    ec.cy = ec.num_trows - 1;
-                }
-
-                int i = ec.rows;
-                while (i--) {
-                    move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-                }
+            // a screen down from the bottom of the screen
+            if (ec.wrap) {
+                measure_rows(ec.row_offset, ec.row_offset + 2 * ec.rows);
+                move_cursor_to_line(screen_top() + 2 * ec.rows - 1);
+            } else {
+                move_cursor_to(ec.row_offset + 2 * ec.rows - 1, ec.cx);
             }
             break;
         case HOME:
@@ -515,7 +1915,7 @@ void process_key(void)
             break;
         case END:
             if (ec.cy < ec.num_trows) {
-                ec.cx = ec.t_rows[ec.cy].size - 1;
+                ec.cx = doc_get(&ec.doc, ec.cy)->size - 1;
             }
             break;
         case CTRL_KEY('h'):
@@ -526,7 +1926,16 @@ void process_key(void)
             move_cursor(ARROW_RIGHT);
             delete_char();
             break;
+        case PASTE: {
+            size_t len;
+            char const *text = pasted_text(&len);
+            insert_text(text, len);
+            break;
+        }
         case CTRL_KEY('l'):
+            // redraw the whole screen
+            screen_invalidate();
+            break;
         case '\x1b':
             break;
         default:
@@ -537,163 +1946,558 @@ void process_key(void)
     quit_times = EDITOR_UNSAVED_QUIT_TIMES;
 }
 
-void text_row_insert_char(text_row *tr, int pos, int c)
+void text_row_insert_char(int at, int pos, int c)
 {
+    text_row *tr = render_row(at);
+
     if (pos < 0 || pos > tr->size) {
         pos = tr->size;
     }
 
-    tr->content = realloc(tr->content, tr->size + 2);
-    memmove(&tr->content[pos + 1], &tr->content[pos], tr->size - pos + 1);
-    tr->content[pos] = c;
+    text_row_reserve(tr, 1);
+    text_row_move_gap(tr, pos);
+    tr->content[tr->gap_start++] = c;
+    tr->gap_len--;
     tr->size++;
+    doc_resize(&ec.doc, at, 1);
 
-    update_text_row(tr);
+    update_text_row_span(tr, at, pos, 1, c == '\t');
     ec.dirty++;
 }
 
-void text_row_delete_char(text_row *tr, int pos)
+void text_row_delete_char(int at, int pos)
 {
+    text_row *tr = render_row(at);
+
     if (pos < 0 || pos >= tr->size) {
         return;
     }
-    memmove(&tr->content[pos], &tr->content[pos + 1], tr->size - pos);
+
+    char c = text_row_char(tr, pos);
+
+    // the deleted character just joins the gap
+    text_row_move_gap(tr, pos);
+    tr->gap_len++;
     tr->size--;
-    update_text_row(tr);
+    doc_resize(&ec.doc, at, -1);
+
+    update_text_row_span(tr, at, pos, -1, c == '\t');
     ec.dirty++;
 }
 
-void text_row_append_string(text_row *tr, char *s, size_t len)
+void text_row_insert_string(int at, int pos, char const *s, size_t len)
 {
-    tr->content = realloc(tr->content, tr->size + len + 1);
-    memcpy(&tr->content[tr->size], s, len);
+    text_row *tr = render_row(at);
+
+    if (pos < 0 || pos > tr->size) {
+        pos = tr->size;
+    }
+
+    text_row_reserve(tr, len);
+    text_row_move_gap(tr, pos);
+    memcpy(&tr->content[pos], s, len);
+    tr->gap_start += len;
+    tr->gap_len -= len;
     tr->size += len;
-    tr->content[tr->size] = '\0';
-    update_text_row(tr);
+    doc_resize(&ec.doc, at, len);
+
+    update_text_row_span(tr, at, pos, len, memchr(s, '\t', len) != NULL);
     ec.dirty++;
 }
 
+void text_row_append_string(int at, char *s, size_t len)
+{
+    text_row_insert_string(at, -1, s, len);
+}
+
+/**
+ * Tells the user the file cannot be changed when it is only viewed, returns
+ * whether that is the case.
+ */
+static int refuse_edit(void)
+{
+    if (ec.read_only) {
+        set_status_msg("Read only, the file was opened with -R");
+    }
+
+    return ec.read_only;
+}
+
 void insert_char(int c)
 {
+    if (refuse_edit()) {
+        return;
+    }
+
     if (ec.cy == ec.num_trows) {
         insert_text_row(ec.num_trows, "", 0);
     }
 
-    text_row_insert_char(&ec.t_rows[ec.cy], ec.cx, c);
+    text_row_insert_char(ec.cy, ec.cx, c);
     ec.cx++;
 }
 
 void insert_new_line(void)
 {
+    if (refuse_edit()) {
+        return;
+    }
+
     if (ec.cx == 0) {
         insert_text_row(ec.cy, "", 0);
     } else {
-        text_row *curr = &ec.t_rows[ec.cy];
-        insert_text_row(ec.cy + 1, &curr->content[ec.cx], curr->size - ec.cx);
+        text_row *curr = render_row(ec.cy);
+        int tail = curr->size - ec.cx;
+        int tabs = text_row_has_tab(curr, ec.cx, curr->size);
+
+        // with the gap at the cursor the rest of the row is contiguous
+        text_row_move_gap(curr, ec.cx);
+        insert_text_row(ec.cy + 1, &curr->content[ec.cx + curr->gap_len],
+                        tail);
 
-        // insert_text_row reallocates the t_rows array, need to reassign curr
-        curr = &ec.t_rows[ec.cy];
+        // insert_text_row may move rows around in the document, need to
+        // reassign curr
+        curr = doc_get(&ec.doc, ec.cy);
 
+        curr->gap_len += tail;
         curr->size = ec.cx;
-        curr->content[curr->size] = '\0';
-        update_text_row(curr);
+        doc_resize(&ec.doc, ec.cy, -tail);
+        update_text_row_span(curr, ec.cy, ec.cx, -tail, tabs);
     }
 
     ec.cy++;
     ec.cx = 0;
 }
 
+/**
+ * Returns the length of the line at the start of s, up to the line break
+ * ending it or the end of s.
+ */
+static size_t line_length(char const *s, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && s[i] != '\r' && s[i] != '\n') {
+        i++;
+    }
+
+    return i;
+}
+
+/**
+ * Returns the length of the line break at the start of s, \r\n being a
+ * single one.
+ */
+static size_t break_length(char const *s, size_t len)
+{
+    if (len >= 2 && s[0] == '\r' && s[1] == '\n') {
+        return 2;
+    }
+
+    return len && (s[0] == '\r' || s[0] == '\n');
+}
+
+void insert_text(char const *s, size_t len)
+{
+    if (!len || refuse_edit()) {
+        return;
+    }
+
+    if (ec.cy == ec.num_trows) {
+        insert_text_row(ec.num_trows, "", 0);
+    }
+
+    size_t first = line_length(s, len);
+    size_t from = first;
+    int lines = 0;
+
+    while (from < len) {
+        from += break_length(&s[from], len - from);
+        from += line_length(&s[from], len - from);
+        lines++;
+    }
+
+    if (!lines) {
+        text_row_insert_string(ec.cy, ec.cx, s, len);
+        ec.cx += len;
+        return;
+    }
+
+    text_row *rows = malloc(sizeof(text_row) * lines);
+
+    if (!rows) {
+        DIE("Failed to allocate memory");
+    }
+
+    text_row *curr = render_row(ec.cy);
+    int tail = curr->size - ec.cx;
+    int tabs = text_row_has_tab(curr, ec.cx, curr->size);
+
+    // with the gap at the cursor the rest of the row is contiguous
+    text_row_move_gap(curr, ec.cx);
+
+    // every line after the first becomes a row of its own, the last one
+    // taking the rest of the row
+    size_t line = 0;
+    int i;
+    from = first;
+    for (i = 0; i < lines; i++) {
+        from += break_length(&s[from], len - from);
+        line = line_length(&s[from], len - from);
+
+        text_row_init(&rows[i], &s[from], line);
+        from += line;
+
+        if (i == lines - 1) {
+            text_row *last = &rows[i];
+
+            text_row_reserve(last, tail);
+            memcpy(&last->content[line], &curr->content[ec.cx + curr->gap_len],
+                   tail);
+            last->gap_start += tail;
+            last->gap_len -= tail;
+            last->size += tail;
+        }
+    }
+
+    // all of the rows go in at once, before any of them is highlighted
+    doc_insert_rows(&ec.doc, ec.cy + 1, lines, rows);
+    shift_pending(ec.cy + 1, lines);
+    ec.num_trows += lines;
+    free(rows);
+
+    curr = doc_get(&ec.doc, ec.cy);
+    curr->gap_len += tail;
+    curr->size = ec.cx;
+    doc_resize(&ec.doc, ec.cy, -tail);
+    update_text_row_span(curr, ec.cy, ec.cx, -tail, tabs);
+
+    if (first) {
+        text_row_insert_string(ec.cy, ec.cx, s, first);
+    }
+
+    // the rows below were highlighted as following the row the text was
+    // pasted into, highlighting them again goes through the pasted rows once
+    text_row *below = doc_get(&ec.doc, ec.cy + lines + 1);
+    if (below && below->highlight_open_comment >= 0) {
+        update_syntax_from(ec.cy + lines + 1);
+    }
+
+    ec.cy += lines;
+    ec.cx = line;
+    ec.dirty++;
+}
+
 void delete_char(void)
 {
+    if (refuse_edit()) {
+        return;
+    }
+
     if (ec.cy == ec.num_trows)
         return;
 
     if (ec.cx == 0 && ec.cy == 0)
         return;
 
-    text_row *action_row = &ec.t_rows[ec.cy];
+    text_row *action_row = doc_get(&ec.doc, ec.cy);
 
     if (ec.cx > 0) {
-        text_row_delete_char(action_row, ec.cx - 1);
+        text_row_delete_char(ec.cy, ec.cx - 1);
         ec.cx--;
     } else {
         assert(ec.cx == 0);
-        ec.cx = ec.t_rows[ec.cy - 1].size;
-        text_row_append_string(&ec.t_rows[ec.cy - 1], action_row->content,
+        ec.cx = doc_get(&ec.doc, ec.cy - 1)->size;
+        // the appended row has to be contiguous
+        text_row_move_gap(action_row, action_row->size);
+        text_row_append_string(ec.cy - 1, action_row->content,
                                action_row->size);
         delete_text_row(ec.cy);
         ec.cy--;
     }
 }
 
-char *rows_to_string(int *buf_len)
+/**
+ * Writes all len bytes of s to fd, going on after the writes that take in
+ * only part of them. Returns -1 on error.
+ */
+static int write_all(int fd, char const *s, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, s, len);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        s += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the rows to fd, each followed by a newline. Short rows are gathered
+ * into chunks of SAVE_CHUNK bytes first, so the file never has to fit in
+ * memory at once. Returns the number of bytes written, -1 on error.
+ */
+static off_t write_rows(int fd)
 {
-    int total_len = 0;
+    abuf chunk = ABUF_INIT;
+    off_t total = 0;
     int i;
 
     for (i = 0; i < ec.num_trows; ++i) {
-        // add one for the newline character
-        total_len += ec.t_rows[i].size + 1;
+        text_row *tr = doc_peek(&ec.doc, i);
+        char const *after_gap = &tr->content[tr->gap_start + tr->gap_len];
+        size_t after_len = tr->size - tr->gap_start;
+
+        if (tr->size >= SAVE_CHUNK) {
+            if (write_all(fd, chunk.buf, chunk.len) == -1 ||
+                write_all(fd, tr->content, tr->gap_start) == -1 ||
+                write_all(fd, after_gap, after_len) == -1) {
+                buf_free(&chunk);
+                return -1;
+            }
+            total += chunk.len + tr->size;
+            buf_clear(&chunk);
+        } else {
+            buf_append(&chunk, tr->content, tr->gap_start);
+            buf_append(&chunk, after_gap, after_len);
+        }
+
+        buf_append(&chunk, "\n", 1);
+
+        if (chunk.len >= SAVE_CHUNK || i == ec.num_trows - 1) {
+            if (write_all(fd, chunk.buf, chunk.len) == -1) {
+                buf_free(&chunk);
+                return -1;
+            }
+            total += chunk.len;
+            buf_clear(&chunk);
+        }
     }
 
-    *buf_len = total_len;
+    buf_free(&chunk);
+    return total;
+}
 
-    char *buf = malloc(total_len);
-    char *tmp = buf;
+static char *replacement_path = NULL;
+static char *replaced_path = NULL;
 
-    for (i = 0; i < ec.num_trows; ++i) {
-        memcpy(tmp, ec.t_rows[i].content, ec.t_rows[i].size);
-        tmp += ec.t_rows[i].size;
-        *tmp = '\n';
-        tmp++;
+/**
+ * Creates a temporary file next to the file at path (following symlinks) with
+ * the same owner and permissions, to be moved over it once fully written. A
+ * file that went away since it was opened gets created at path that way.
+ *
+ * Returns -1 if the file is better written in place: when the temporary file
+ * cannot be created, or would not end up the same as the file, which is the
+ * case for files with other links to them and owned by someone else.
+ */
+static int open_replacement(char const *path)
+{
+    char *target = realpath(path, NULL);
+    struct stat st;
+
+    if (!target && errno == ENOENT) {
+        mode_t mask = umask(0);
+
+        umask(mask);
+        target = strdup(path);
+        if (!target) {
+            DIE("Failed to allocate memory");
+        }
+        st.st_mode = (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) & ~mask;
+        // the new file keeps the owner it gets created with
+        st.st_uid = -1;
+        st.st_gid = -1;
+        st.st_nlink = 1;
+    } else if (!target || stat(target, &st) == -1) {
+        FREE(target);
+        return -1;
+    }
+
+    if (st.st_nlink > 1) {
+        FREE(target);
+        return -1;
+    }
+
+    FREE(replacement_path);
+    FREE(replaced_path);
+    replaced_path = target;
+    replacement_path = malloc(strlen(target) + 8);
+
+    if (!replacement_path) {
+        DIE("Failed to allocate memory");
     }
 
-    return buf;
+    sprintf(replacement_path, "%s.XXXXXX", target);
+
+    int fd = mkstemp(replacement_path);
+
+    if (fd != -1 && (fchown(fd, st.st_uid, st.st_gid) == -1 ||
+                     fchmod(fd, st.st_mode & 07777) == -1)) {
+        close(fd);
+        unlink(replacement_path);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Moves the temporary file created by open_replacement over the file it
+ * replaces, or removes it if that fails.
+ */
+static int commit_replacement(void)
+{
+    int ret = rename(replacement_path, replaced_path);
+
+    if (ret == -1) {
+        int saved = errno;
+        unlink(replacement_path);
+        errno = saved;
+    }
+
+    return ret;
+}
+
+/**
+ * Copies every row still pointing into the mapped file into a buffer of its
+ * own and lets go of the mapping, for the file to be written over in place.
+ */
+static void unmap_file(void)
+{
+    int i;
+
+    // the highlight worker may be reading rows from the mapping
+    highlight_worker_stop();
+    job_n = 0;
+
+    for (i = 0; i < ec.num_trows; i++) {
+        text_row_own(doc_get(&ec.doc, i));
+    }
+
+    munmap((void *)ec.map, ec.map_size);
+    ec.map = NULL;
+    ec.map_size = 0;
+}
+
+/**
+ * Writes the rows over the file at path, creating it if needed. Returns the
+ * number of bytes written, -1 on error.
+ */
+static off_t write_in_place(char const *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); /* 0644 */
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    off_t len = write_rows(fd);
+
+    // an existing file may have been longer than what replaced it
+    if (len != -1 && ftruncate(fd, len) == -1) {
+        len = -1;
+    }
+
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return len;
 }
 
 void save(void)
 {
+    if (refuse_edit()) {
+        return;
+    }
+
     if (ec.filename == NULL) {
         ec.filename = prompt("Save file as: %s", NULL);
         if (!ec.filename) {
             set_status_msg("Saving cancelled");
             return;
         }
+        // every row gets highlighted again or forgets its highlight
+        stop_highlight();
         select_syntax_highlight();
     }
 
-    int len;
-    char *buf = rows_to_string(&len);
+    // the rows not loaded yet are part of the file too
+    loader_finish();
+
+    off_t len = -1;
+
+    // unedited rows still read from the mapped file, which must not change
+    // under them: write a new file and move it over the old one instead
+    int fd = ec.map ? open_replacement(ec.filename) : -1;
 
-    // create file if it does not exist
-    int fd = open(ec.filename, O_RDWR | O_CREAT,
-                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH); /* 0644 permissions */
     if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                FREE(buf);
-                set_status_msg("\"%s\" %d Line%s, %d bytes written",
-                               ec.filename, ec.num_trows,
-                               ec.num_trows == 1 ? "" : "s", len);
-                ec.dirty = 0;
-                return;
-            }
-        }
+        len = write_rows(fd);
+
+        int saved = errno;
         close(fd);
+
+        if (len == -1) {
+            unlink(replacement_path);
+            errno = saved;
+            set_status_msg("Cannot write: I/O error: %s", strerror(errno));
+            return;
+        }
+
+        if (commit_replacement() == -1) {
+            len = -1;
+        }
+    }
+
+    // the file could not be replaced, the rows then stop reading from it for
+    // it to be written over
+    if (len == -1) {
+        if (ec.map) {
+            unmap_file();
+        }
+        len = write_in_place(ec.filename);
     }
 
-    FREE(buf);
-    set_status_msg("Cannot write: I/O error: %s", strerror(errno));
+    if (len == -1) {
+        set_status_msg("Cannot write: I/O error: %s", strerror(errno));
+        return;
+    }
+
+    set_status_msg("\"%s\" %d Line%s, %lld bytes written", ec.filename,
+                   ec.num_trows, ec.num_trows == 1 ? "" : "s", (long long)len);
+    ec.dirty = 0;
 }
 
 void handle_win_resize(int sig)
 {
+    // the screen is only touched outside of the handler, it may be in the
+    // middle of a frame
+    win_resized = 1;
+    event_wake();
+    signal(sig, handle_win_resize);
+}
+
+int take_win_resize(void)
+{
+    if (!win_resized) {
+        return 0;
+    }
+
+    win_resized = 0;
+
     if (get_window_size(&ec.rows, &ec.cols) == -1) {
         DIE("Could not get window size");
     }
 
     ec.rows -= 2;
-    refresh_screen();
-    signal(sig, handle_win_resize);
+    screen_invalidate();
+    return 1;
 }
@@ -5,6 +5,7 @@
 #include <termios.h>
 
 #include "append_buffer.h"
+#include "document.h"
 
 #define EDITOR_VERSION "0.0.1"
 #define EDITOR_NAME "STEQS"
@@ -12,16 +13,24 @@
 #define EDITOR_DEFAULT_LINE_NUMBER_PADDING 5
 
 #define TAB_STOP 8
-
-typedef struct {
-    int index;
-    int size;
-    int render_size;
-    char *content;
-    char *to_render;
-    unsigned char *highlight;
-    int highlight_open_comment;
-} text_row;
+// rows longer than this keep the render column of every COLUMN_STEP-th
+// character, so finding the cursor on them does not walk the whole row
+#define COLUMN_STEP 1024
+// rows longer than this are only rendered and highlighted around the columns
+// on screen
+#define LONG_ROW_SIZE (256 * 1024)
+// leaves of DOC_LEAF_ROWS rows whose renders are kept around once used
+#define RENDER_CACHE_LEAVES 32
+// leaves kept around the screen when the file is only viewed
+#define VIEW_WINDOW_LEAVES 4
+// rows highlighted at most on the way to one that gets shown, those further
+// away are left to the highlight worker. A file that is only viewed keeps the
+// highlight state of every HIGHLIGHT_SLICE-th row
+#define HIGHLIGHT_SLICE 1024
+// rows handed to the highlight worker at a time
+#define HIGHLIGHT_BATCH (16 * HIGHLIGHT_SLICE)
+// bytes of rows gathered before they get written out on save
+#define SAVE_CHUNK (64 * 1024)
 
 typedef struct {
     char const *file_type;
@@ -31,10 +40,28 @@ typedef struct {
     char const *multiline_comment_start;
     char const *multiline_comment_end;
     int flags;
+    // worked out once the syntax first gets selected: the class of every
+    // character, lengths of the comment delimiters, and the keywords sorted
+    // by first character and length, those starting with character c being
+    // the ones in [keyword_start[c], keyword_start[c + 1])
+    unsigned char classes[256];
+    int scs_len;
+    int mcs_len;
+    int mce_len;
+    unsigned char *keyword_len;
+    int keyword_max;
+    int keyword_start[257];
+    // characters that always end a run of plain text, and whether the runs
+    // can be scanned for them and for words starting after a separator 16
+    // characters at a time, see HIGHLIGHT_SSE2 in highlight.c
+    unsigned char run_stops[4];
+    int scan_runs;
 } syntax;
 
 typedef struct {
     struct termios default_settings;
+    // file status flags of the terminal before writes were made non-blocking
+    int default_out_flags;
     syntax *syntax;
     int cx;   // cursor column position
     int cy;   // cursor row position
@@ -42,12 +69,22 @@ typedef struct {
     int rows; // terminal window height
     int cols; // terminal window width
     int num_trows;
-    text_row *t_rows;
+    document doc;
     int row_offset;
     int col_offset;
+    // rows wider than the screen go on over the lines below instead of
+    // scrolling sideways, the screen then starts at line wrap_offset of the
+    // row at row_offset
+    int wrap;
+    int wrap_offset;
     char *filename;
+    // read only mapping of the opened file, unedited rows point into it
+    char const *map;
+    size_t map_size;
     char status_msg[96];
     int dirty;
+    // opened with -R, the file is only viewed and never edited
+    int read_only;
     int prompting;
     int line_number_padding;
 } editor_config;
@@ -72,18 +109,61 @@ void insert_text_row(int pos, char *content, size_t len);
 
 void delete_text_row(int pos);
 
-void update_text_row(text_row *row);
+void update_text_row(text_row *row, int at);
 
 void free_text_row(text_row *tr);
 
+/**
+ * Returns the content of the row as a contiguous run of characters, not
+ * terminated by a null byte.
+ */
+char const *text_row_text(text_row *tr);
+
+/**
+ * Returns the row at the given position with its render and highlight
+ * computed, which only happens once a row gets shown or edited.
+ */
+text_row *render_row(int at);
+
+/**
+ * Takes in what the highlight worker worked out for the rows it was handed,
+ * and hands it the next rows left for later or wanted on screen while shown
+ * plain. Returns whether rows got highlighted.
+ */
+int highlight_poll(void);
+
+/**
+ * Lets the kernel take back the pages of the mapped file holding anything
+ * between the two positions, they are read from the file again if needed.
+ */
+void release_mapped(char const *from, char const *to);
+
+int row_cx_to_rx(text_row *tr, int cx);
+
 int row_rx_to_cx(text_row *tr, int rx);
 
-void draw_row_tildes(abuf *buf);
+/**
+ * Returns the screen line of the wrapped row that column rx of its render is
+ * on.
+ */
+int row_rx_to_line(text_row *tr, int rx);
+
+/**
+ * Draws the line at index i of the screen, the row of the file it shows or a
+ * tilde past the end of the file.
+ */
+void draw_row(abuf *buf, int i);
 
 void scroll(void);
 
 void insert_char(int c);
 
+/**
+ * Inserts the text at the cursor as is, the rows its lines make going into
+ * the document at once. The cursor ends up after the text.
+ */
+void insert_text(char const *s, size_t len);
+
 void delete_char(void);
 
 void insert_new_line(void);
@@ -92,4 +172,10 @@ void save(void);
 
 void handle_win_resize(int sig);
 
+/**
+ * Picks up the new size of the window if it changed since the last call,
+ * returns whether it did.
+ */
+int take_win_resize(void);
+
 #endif // INCLUDE_SRC_EDITOR_H_
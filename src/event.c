@@ -0,0 +1,88 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "event.h"
+#include "util.h"
+
+// written to by event_wake, read by event_wait: writing to a pipe is safe
+// from a signal handler and wakes up a poll
+static int wake_pipe[2] = {-1, -1};
+static int watch_output;
+
+void event_init(void)
+{
+    if (pipe(wake_pipe) == -1) {
+        DIE("pipe: Unable to create the wake up pipe");
+    }
+
+    // a full pipe already wakes the UI, writes are dropped rather than
+    // blocking the writer, and draining it stops once empty
+    int i;
+    for (i = 0; i < 2; i++) {
+        int flags = fcntl(wake_pipe[i], F_GETFL);
+        if (flags == -1 ||
+            fcntl(wake_pipe[i], F_SETFL, flags | O_NONBLOCK) == -1 ||
+            fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC) == -1) {
+            DIE("fcntl: Unable to set up the wake up pipe");
+        }
+    }
+}
+
+void event_wake(void)
+{
+    int saved_errno = errno;
+    char c = 0;
+
+    // fails only if the pipe is full, with a wake up already pending
+    write(wake_pipe[1], &c, 1);
+
+    errno = saved_errno;
+}
+
+void event_watch_output(int on)
+{
+    watch_output = on;
+}
+
+int event_wait(int timeout)
+{
+    // poll leaves out negative file descriptors
+    struct pollfd fds[3] = {{STDIN_FILENO, POLLIN, 0},
+                            {wake_pipe[0], POLLIN, 0},
+                            {watch_output ? STDOUT_FILENO : -1, POLLOUT, 0}};
+    int res;
+
+    // a signal interrupting the poll also wakes it through the pipe
+    while ((res = poll(fds, 3, timeout)) == -1) {
+        if (errno != EINTR) {
+            DIE("poll: Unable to wait for input");
+        }
+    }
+
+    if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        DIE("The terminal went away");
+    }
+
+    int events = 0;
+
+    if (fds[0].revents & POLLIN) {
+        events |= EVENT_INPUT;
+    }
+
+    if (fds[1].revents & POLLIN) {
+        char drain[64];
+        while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {
+        }
+        events |= EVENT_WAKE;
+    }
+
+    if (fds[2].revents & POLLOUT) {
+        events |= EVENT_OUTPUT;
+    }
+
+    return events;
+}
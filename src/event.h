@@ -0,0 +1,33 @@
+#ifndef INCLUDE_SRC_EVENT_H_
+#define INCLUDE_SRC_EVENT_H_
+
+// input is waiting on the terminal
+#define EVENT_INPUT (1 << 0)
+// a signal handler or the loader asked for the screen to be looked at again
+#define EVENT_WAKE (1 << 1)
+// the terminal can take more output, only while it is watched for
+#define EVENT_OUTPUT (1 << 2)
+
+/**
+ * Sets up the pipe event_wake writes to, before anything can wake the UI.
+ */
+void event_init(void);
+
+/**
+ * Wakes up the UI thread from a signal handler or another thread.
+ */
+void event_wake(void);
+
+/**
+ * Sets whether event_wait also waits for the terminal to take more output.
+ */
+void event_watch_output(int on);
+
+/**
+ * Sleeps until input comes, something wakes the UI or the terminal can take
+ * more output if watched for, for at most timeout milliseconds unless
+ * negative. Returns what happened as EVENT_* flags, none if the time ran out.
+ */
+int event_wait(int timeout);
+
+#endif // INCLUDE_SRC_EVENT_H_
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <string.h>
 
 #include "editor.h"
@@ -31,8 +33,12 @@ void find_callback(char *query, int key)
     static char *previous_hl = NULL;
 
     if (previous_hl) {
-        memcpy(ec.t_rows[previous_hl_line].highlight, previous_hl,
-               ec.t_rows[previous_hl_line].render_size);
+        text_row *prev_row = doc_get(&ec.doc, previous_hl_line);
+        // a dropped render comes back without the match highlighted
+        if (prev_row->highlight) {
+            memcpy(prev_row->highlight, previous_hl,
+                   HL_BYTES(prev_row->render_size));
+        }
         FREE(previous_hl);
     }
 
@@ -69,21 +75,57 @@ void find_callback(char *query, int key)
             current = 0;
         }
 
-        text_row *row = &ec.t_rows[current];
-        char *match = strstr(row->to_render, query);
+        text_row *row = doc_peek(&ec.doc, current);
+        int query_len = strlen(query);
+
+        // long rows are only rendered around the screen, their content is
+        // searched instead and the cursor shows the match
+        if (row->size > LONG_ROW_SIZE) {
+            char const *text = text_row_text(row);
+            char const *match = memmem(text, row->size, query, query_len);
+
+            if (match) {
+                matches++;
+                last_match = current;
+                ec.cy = current;
+                ec.cx = match - text;
+                ec.row_offset = ec.num_trows;
+                break;
+            }
+            continue;
+        }
+
+        // rows not rendered yet only render when the query is in their
+        // content, which then also is in their render unless tabs got in
+        // the way
+        if (!row->highlight) {
+            char const *text = text_row_text(row);
+            if (!memmem(text, row->size, query, query_len) &&
+                !memchr(text, '\t', row->size)) {
+                continue;
+            }
+        }
+
+        row = render_row(current);
+
+        // rows without tabs render as their content
+        char const *render =
+            row->to_render ? row->to_render : text_row_text(row);
+        char const *match = memmem(render, row->render_size, query, query_len);
 
         if (match) {
+            int at = match - render;
+
             matches++;
             last_match = current;
             ec.cy = current;
-            ec.cx = row_rx_to_cx(row, match - row->to_render);
+            ec.cx = row_rx_to_cx(row, at);
             ec.row_offset = ec.num_trows;
 
             previous_hl_line = current;
-            previous_hl = malloc(row->render_size);
-            memcpy(previous_hl, row->highlight, row->render_size);
-            memset(&row->highlight[match - row->to_render], HL_MATCH,
-                   strlen(query));
+            previous_hl = malloc(HL_BYTES(row->render_size));
+            memcpy(previous_hl, row->highlight, HL_BYTES(row->render_size));
+            text_row_fill_hl(row, at, at + query_len, HL_MATCH);
             break;
         }
     }
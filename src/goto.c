@@ -0,0 +1,49 @@
+#include <stdlib.h>
+
+#include "cursor.h"
+#include "editor.h"
+#include "goto.h"
+#include "loader.h"
+#include "status_bar.h"
+#include "util.h"
+
+void go_to(void)
+{
+    char *query = prompt("Go to line (@ for a byte offset): %s", NULL);
+
+    if (!query) {
+        return;
+    }
+
+    int is_offset = query[0] == '@';
+    char *end;
+    long target = strtol(&query[is_offset], &end, 10);
+
+    if (end == &query[is_offset] || *end != '\0' ||
+        target < (is_offset ? 0 : 1)) {
+        set_status_msg("Not a line or a byte offset: %s", query);
+        FREE(query);
+        return;
+    }
+
+    FREE(query);
+
+    // the rows past the ones indexed so far do not exist yet
+    if (target >= (is_offset ? doc_offset(&ec.doc, ec.num_trows)
+                             : ec.num_trows)) {
+        loader_finish();
+    }
+
+    if (is_offset) {
+        int cy = doc_find_offset(&ec.doc, &target);
+        move_cursor_to(cy, target);
+    } else {
+        move_cursor_to(target - 1, 0);
+    }
+
+    // show the target in the middle of the screen
+    ec.row_offset = ec.cy - ec.rows / 2;
+    if (ec.row_offset < 0) {
+        ec.row_offset = 0;
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef INCLUDE_SRC_GOTO_H_
+#define INCLUDE_SRC_GOTO_H_
+
+/**
+ * Launches a prompt for jumping to a line of the currently opened file, or to
+ * a byte offset when the input starts with @
+ */
+void go_to(void);
+
+#endif // INCLUDE_SRC_GOTO_H_
@@ -1,8 +1,23 @@
+#define _DEFAULT_SOURCE
+
 #include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+// runs of plain text scanned 16 characters at a time, only built on request
+// as it turned out slower than going character by character: the next
+// character ending a run is most often only a few characters away. See
+// bench/highlight_bench.c
+#if defined(HIGHLIGHT_SSE2) && defined(__SSE2__)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
 #include "editor.h"
 #include "highlight.h"
+#include "util.h"
 
 #define HIGHLIGHT_DB_ENTRIES (sizeof(HIGHLIGHT_DB) / sizeof(HIGHLIGHT_DB[0]))
 
@@ -42,138 +57,887 @@ syntax HIGHLIGHT_DB[] = {{.file_type = "C",
 
 };
 
+// classes of characters, a syntax's table telling the ones of every byte
+// the highlighter stops at, see compile_syntax
+#define CC_SEPARATOR (1 << 0)
+// first character of a comment delimiter
+#define CC_COMMENT (1 << 1)
+#define CC_QUOTE (1 << 2)
+#define CC_DIGIT (1 << 3)
+#define CC_DOT (1 << 4)
+// first character of a keyword
+#define CC_KEYWORD (1 << 5)
+
 static int is_separator(int c)
 {
     return isspace(c) || c == '\0' || strchr("().,/+-=*~%<>[];", c) != NULL;
 }
 
-void update_syntax(text_row *tr)
+/**
+ * Returns the render of the row as a single string, indexed from the render's
+ * first column. A row rendering straight from its content gets copied into
+ * *copy while the gap is in the middle, for the caller to free.
+ */
+static char const *render_text(text_row const *tr, char **copy)
 {
-    tr->highlight = realloc(tr->highlight, tr->render_size);
-    memset(tr->highlight, HL_NORMAL, tr->render_size);
+    *copy = NULL;
 
-    // no file type
-    if (ec.syntax == NULL) {
-        return;
+    if (tr->to_render) {
+        return tr->to_render;
     }
 
-    char const *scs = ec.syntax->single_line_comment_start;
-    char const *mcs = ec.syntax->multiline_comment_start;
-    char const *mce = ec.syntax->multiline_comment_end;
+    if (tr->gap_start >= tr->size) {
+        return tr->content;
+    }
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+    *copy = malloc(tr->size + 1);
 
-    int prev_separator = 1;
-    int quote = 0;
-    int multiline_comment =
-        (tr->index > 0 && ec.t_rows[tr->index - 1].highlight_open_comment);
+    if (!*copy) {
+        DIE("Failed to allocate memory");
+    }
 
-    int i = 0;
-    while (i < tr->render_size) {
-        unsigned char prev_highlight;
+    memcpy(*copy, tr->content, tr->gap_start);
+    memcpy(&(*copy)[tr->gap_start], &tr->content[tr->gap_start + tr->gap_len],
+           tr->size - tr->gap_start);
 
-        if (i > 0) {
-            prev_highlight = tr->highlight[i - 1];
-        } else {
-            prev_highlight = HL_NORMAL;
+    return *copy;
+}
+
+/**
+ * Checks whether the n characters of text continue with the len characters of
+ * s from index i on.
+ */
+static int text_has(char const *text, int n, int i, char const *s, int len)
+{
+    return i + len <= n && memcmp(&text[i], s, len) == 0;
+}
+
+/**
+ * Returns the index of the first of the len characters of s in the n
+ * characters of text from index i on, n if they are not there.
+ */
+static int text_find(char const *text, int n, int i, char const *s, int len)
+{
+    while (i + len <= n) {
+        char const *p = memchr(&text[i], s[0], n - len + 1 - i);
+
+        if (!p) {
+            break;
         }
 
-        char c = tr->to_render[i];
+        i = p - text;
+        if (memcmp(p, s, len) == 0) {
+            return i;
+        }
+        i++;
+    }
+
+    return n;
+}
+
+/**
+ * Returns the length of the keyword the n characters of text have at index
+ * i, followed by a separator, or 0 if the word there is not one. The word
+ * only gets compared with the keywords of its first character and length.
+ */
+static int keyword_at(char const *text, int n, int i)
+{
+    syntax const *s = ec.syntax;
+    unsigned char c = text[i];
+    int k = s->keyword_start[c];
+    int end = s->keyword_start[c + 1];
+    int len = 1;
+
+    while (len <= s->keyword_max && i + len < n &&
+           !(s->classes[(unsigned char)text[i + len]] & CC_SEPARATOR)) {
+        len++;
+    }
+
+    for (; k < end && s->keyword_len[k] <= len; k++) {
+        if (s->keyword_len[k] == len &&
+            memcmp(&text[i], s->keywords[k], len) == 0) {
+            return len;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef USE_SSE2
+/**
+ * Returns the lanes of v holding a character in [lo, hi].
+ */
+static __m128i lanes_in_range(__m128i v, char lo, char hi)
+{
+    // v - lo being no more than hi - lo as unsigned bytes
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(hi - lo)), d);
+}
+
+static __m128i lanes_equal(__m128i v, char c)
+{
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+}
+
+/**
+ * Returns a mask of the lanes of v holding a separator, bit k standing for
+ * lane k. These are the separators of is_separator in the C locale, a syntax
+ * whose table of classes tells otherwise does not get scanned.
+ */
+static unsigned int separator_lanes(__m128i v)
+{
+    __m128i sep = _mm_or_si128(lanes_in_range(v, '\t', '\r'),
+                               lanes_in_range(v, '(', '/'));
 
-        // Highlight single line comments except the ones that are inside
-        // a string or a multiline comment
-        if (scs_len && !quote && !multiline_comment) {
-            if (!strncmp(&tr->to_render[i], scs, scs_len)) {
-                memset(&tr->highlight[i], HL_COMMENT, tr->render_size - i);
+    sep = _mm_or_si128(sep, lanes_in_range(v, ';', '>'));
+    sep = _mm_or_si128(sep, _mm_or_si128(lanes_equal(v, ' '),
+                                         lanes_equal(v, '\0')));
+    sep = _mm_or_si128(sep, _mm_or_si128(lanes_equal(v, '%'),
+                                         lanes_equal(v, '~')));
+    sep = _mm_or_si128(sep, _mm_or_si128(lanes_equal(v, '['),
+                                         lanes_equal(v, ']')));
+
+    return _mm_movemask_epi8(sep);
+}
+
+// the block of 16 characters of a row last looked at for the ones that may
+// end a run of plain text, bit k of stops telling for the one at from + k
+typedef struct {
+    unsigned char const *classes;
+    __m128i run_stops[4];
+    int from;
+    int to;
+    unsigned int stops;
+} plain_scan;
+
+static void plain_scan_init(plain_scan *scan, syntax const *s)
+{
+    int i;
+
+    scan->classes = s->classes;
+    for (i = 0; i < 4; i++) {
+        scan->run_stops[i] = _mm_set1_epi8(s->run_stops[i]);
+    }
+    scan->from = scan->to = 0;
+    scan->stops = 0;
+}
+
+/**
+ * Returns the index of the first character of text from index at on that may
+ * end a run of plain text: one that can start a comment or a string, or the
+ * start of a word following a separator. Only blocks of 16 characters ending
+ * before limit get looked at, the index of the first character not looked at
+ * is returned when none of them may.
+ */
+static int skip_plain(plain_scan *scan, char const *text, int at, int limit)
+{
+    for (;;) {
+        if (at < scan->from || at >= scan->to) {
+            if (at + 16 > limit) {
+                return at;
+            }
+
+            __m128i v = _mm_loadu_si128((__m128i const *)&text[at]);
+            unsigned int sep = separator_lanes(v);
+            // lanes following a separator, the first one following the
+            // character before the block
+            unsigned int after_sep =
+                sep << 1 |
+                !!(scan->classes[(unsigned char)text[at - 1]] & CC_SEPARATOR);
+            __m128i stops =
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, scan->run_stops[0]),
+                                          _mm_cmpeq_epi8(v, scan->run_stops[1])),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, scan->run_stops[2]),
+                                          _mm_cmpeq_epi8(v, scan->run_stops[3])));
+
+            scan->from = at;
+            scan->to = at + 16;
+            scan->stops =
+                (_mm_movemask_epi8(stops) | (after_sep & ~sep)) & 0xffff;
+        }
+
+        unsigned int stops = scan->stops >> (at - scan->from);
+
+        if (stops) {
+            return at + __builtin_ctz(stops);
+        }
+
+        at = scan->to;
+    }
+}
+#endif
+
+/**
+ * Highlights the row from index start of its render on, the character before
+ * start being a separator highlighted as normal text. From index stop on the
+ * highlight is the one from before the last edit, shifted into place, and the
+ * work ends as soon as the tokenizer is found back in its old state.
+ *
+ * The syntax's character classes tell which characters can start anything
+ * but plain text, runs of anything else get highlighted at once. A row whose
+ * highlight got cleared beforehand leaves them as they are. Long runs are
+ * scanned 16 characters at a time with USE_SSE2 where the syntax allows.
+ */
+static int highlight_row(text_row *tr, int open_comment, int start, int stop,
+                         int cleared)
+{
+    syntax const *s = ec.syntax;
+    unsigned char const *classes = s->classes;
+    char const *scs = s->single_line_comment_start;
+    char const *mcs = s->multiline_comment_start;
+    char const *mce = s->multiline_comment_end;
+
+    int scs_len = s->scs_len;
+    int mcs_len = s->mcs_len;
+    int mce_len = s->mce_len;
+
+    char *copy;
+    char const *text = render_text(tr, &copy);
+    // indices below are from the render's first column
+    int base = tr->render_start;
+    int n = tr->render_size - base;
+    int i = start - base;
+
+    int prev_separator = 1;
+    int prev_highlight = i > 0 ? text_row_hl(tr, start - 1) : HL_NORMAL;
+    int multiline_comment = i == 0 && open_comment;
+
+    stop -= base;
+
+#ifdef USE_SSE2
+    plain_scan scan;
+    // the highlight from stop on is looked at character by character
+    int scan_limit = stop < n ? stop : n;
+
+    plain_scan_init(&scan, s);
+#endif
+
+    while (i < n) {
+        if (multiline_comment && mcs_len && mce_len) {
+            int end = text_find(text, n, i, mce, mce_len);
+
+            text_row_fill_hl(tr, base + i, base + end, HL_COMMENT);
+            if (end == n) {
                 break;
             }
+
+            text_row_fill_hl(tr, base + end, base + end + mce_len,
+                             HL_MULTILINE_COMMENT);
+            i = end + mce_len;
+            multiline_comment = 0;
+            prev_separator = 1;
+            prev_highlight = HL_MULTILINE_COMMENT;
+            continue;
         }
 
-        // Highlight multiline comments
-        if (mcs_len && mce_len && !quote) {
-            if (multiline_comment) {
-                tr->highlight[i] = HL_COMMENT;
-                if (strncmp(&tr->to_render[i], mce, mce_len) == 0) {
-                    memset(&tr->highlight[i], HL_MULTILINE_COMMENT, mce_len);
-                    i += mce_len;
-                    multiline_comment = 0;
-                    prev_separator = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (strncmp(&tr->to_render[i], mcs, mcs_len) == 0) {
-                memset(&tr->highlight[i], HL_MULTILINE_COMMENT, mcs_len);
+        unsigned char c = text[i];
+        int class = classes[c];
+
+        if (class & CC_COMMENT) {
+            // single line comments, except inside of a multiline one
+            if (scs_len && !multiline_comment &&
+                text_has(text, n, i, scs, scs_len)) {
+                text_row_fill_hl(tr, base + i, base + n, HL_COMMENT);
+                break;
+            }
+
+            if (mcs_len && mce_len && text_has(text, n, i, mcs, mcs_len)) {
+                text_row_fill_hl(tr, base + i, base + i + mcs_len,
+                                 HL_MULTILINE_COMMENT);
                 i += mcs_len;
                 multiline_comment = 1;
+                prev_highlight = HL_MULTILINE_COMMENT;
                 continue;
             }
         }
 
-        if (ec.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (quote) { // we're still inside a string
-                tr->highlight[i] = HL_STRING;
-                if (c == quote) { // matching second quote
-                    if (i - 1 > 0 && tr->to_render[i - 1] != '\\') {
-                        // if this is not an escaped quote, end the string
-                        quote = 0;
-                        prev_separator = 1;
-                    }
-                }
-                i++;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    quote = c; // start of a string
-                    tr->highlight[i] = HL_STRING;
-                    i++;
-                    continue;
+        if (class & CC_QUOTE) {
+            // the string ends at the next matching quote not escaped, or with
+            // the row
+            int end = i;
+
+            do {
+                char const *p = memchr(&text[end + 1], c, n - end - 1);
+                end = p ? p - text : n;
+            } while (end < n && !(base + end - 1 > 0 && text[end - 1] != '\\'));
+
+            if (end == n) {
+                text_row_fill_hl(tr, base + i, base + n, HL_STRING);
+                break;
+            }
+
+            text_row_fill_hl(tr, base + i, base + end + 1, HL_STRING);
+            i = end + 1;
+            prev_separator = 1;
+            prev_highlight = HL_STRING;
+            continue;
+        }
+
+        if (((class & CC_DIGIT) &&
+             (prev_separator || prev_highlight == HL_NUMBER)) ||
+            ((class & CC_DOT) && prev_highlight == HL_NUMBER)) {
+            int end = i + 1;
+
+            // digits and dots go on with the number, unless they could start
+            // a comment or a string
+            while (end < n) {
+                int next = classes[(unsigned char)text[end]];
+                if (!(next & (CC_DIGIT | CC_DOT)) ||
+                    (next & (CC_COMMENT | CC_QUOTE))) {
+                    break;
                 }
+                end++;
             }
+
+            text_row_fill_hl(tr, base + i, base + end, HL_NUMBER);
+            i = end;
+            prev_separator = 0;
+            prev_highlight = HL_NUMBER;
+            continue;
         }
 
-        if (ec.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) &&
-                 (prev_separator || prev_highlight == HL_NUMBER)) ||
-                (c == '.' && prev_highlight == HL_NUMBER)) {
-                tr->highlight[i] = HL_NUMBER;
-                i++;
+        if (prev_separator && (class & CC_KEYWORD)) {
+            int len = keyword_at(text, n, i);
+            if (len) {
+                text_row_fill_hl(tr, base + i, base + i + len, HL_KEYWORD);
+                i += len;
                 prev_separator = 0;
+                prev_highlight = HL_KEYWORD;
                 continue;
             }
         }
 
-        char const **keywords = ec.syntax->keywords;
-        if (prev_separator) {
-            int j = 0;
-            while (keywords[j]) {
-                int keyword_len = strlen(keywords[j]);
-                if (strncmp(&tr->to_render[i], keywords[j], keyword_len) == 0 &&
-                    is_separator(tr->to_render[i + keyword_len])) {
-                    memset(&tr->highlight[i], HL_KEYWORD, keyword_len);
-                    i += keyword_len;
-                    break;
+        // plain text up to the next character that can start anything else
+        int end = i;
+
+        for (;;) {
+            prev_separator = class & CC_SEPARATOR;
+
+            // a separator that was plain text before the edit too: the rest
+            // of the row and its open comment state are unchanged
+            if (end >= stop && prev_separator &&
+                text_row_hl(tr, base + end) == HL_NORMAL) {
+                text_row_fill_hl(tr, base + i, base + end, HL_NORMAL);
+                free(copy);
+                return tr->highlight_open_comment;
+            }
+
+            if (++end == n) {
+                break;
+            }
+
+#ifdef USE_SSE2
+            if (s->scan_runs && end - i >= 16 && end < scan_limit) {
+                int next = skip_plain(&scan, text, end, scan_limit);
+
+                if (next > end) {
+                    end = next;
+                    if (end == n) {
+                        break;
+                    }
+                    prev_separator =
+                        classes[(unsigned char)text[end - 1]] & CC_SEPARATOR;
                 }
-                j++;
             }
-            if (keywords[j] != NULL) {
-                prev_separator = 0;
-                continue;
+#endif
+
+            class = classes[(unsigned char)text[end]];
+            if (class & (CC_COMMENT | CC_QUOTE)) {
+                break;
+            }
+            if (prev_separator && (class & (CC_DIGIT | CC_KEYWORD))) {
+                break;
             }
         }
 
-        prev_separator = is_separator(c);
-        i++;
+        if (!cleared) {
+            text_row_fill_hl(tr, base + i, base + end, HL_NORMAL);
+        }
+        i = end;
+        prev_highlight = HL_NORMAL;
     }
 
-    int changed = (tr->highlight_open_comment != multiline_comment);
+    free(copy);
     tr->highlight_open_comment = multiline_comment;
-    if (changed && tr->index + 1 < ec.num_trows) {
-        update_syntax(&ec.t_rows[tr->index + 1]);
+    return multiline_comment;
+}
+
+int update_syntax(text_row *tr, int open_comment)
+{
+    memset(tr->highlight, HL_NORMAL,
+           HL_BYTES(tr->render_size - tr->render_start));
+
+    // no file type
+    if (ec.syntax == NULL) {
+        tr->highlight_open_comment = 0;
+        return 0;
+    }
+
+    if (open_comment < 0) {
+        tr->highlight_open_comment = -1;
+        return -1;
     }
+
+    return highlight_row(tr, open_comment, tr->render_start, tr->render_size,
+                         1);
+}
+
+int update_syntax_span(text_row *tr, int open_comment, int from, int to)
+{
+    if (ec.syntax == NULL) {
+        text_row_fill_hl(tr, from, to, HL_NORMAL);
+        return 0;
+    }
+
+    // the rest of a plain row is no place to start from
+    if (open_comment < 0 || tr->highlight_open_comment < 0) {
+        return update_syntax(tr, open_comment);
+    }
+
+    int lengths[] = {ec.syntax->scs_len, ec.syntax->mcs_len,
+                     ec.syntax->mce_len};
+    int lookahead = 1;
+    unsigned int j;
+
+    for (j = 0; j < sizeof(lengths) / sizeof(lengths[0]); ++j) {
+        if (lengths[j] > lookahead) {
+            lookahead = lengths[j];
+        }
+    }
+
+    // restart after a plain separator far enough from the edit for no
+    // comment delimiter to reach into it, the tokenizer state is known there
+    int start = from - lookahead + 1;
+
+    if (start < 0) {
+        start = 0;
+    }
+
+    while (start > 0 &&
+           !(text_row_hl(tr, start - 1) == HL_NORMAL &&
+             (ec.syntax->classes[(unsigned char)text_row_render_char(
+                  tr, start - 1)] &
+              CC_SEPARATOR))) {
+        start--;
+    }
+
+    return highlight_row(tr, open_comment, start, to, 0);
+}
+
+static int compare_keywords(void const *a, void const *b)
+{
+    char const *x = *(char const *const *)a;
+    char const *y = *(char const *const *)b;
+
+    if (x[0] != y[0]) {
+        return (unsigned char)x[0] - (unsigned char)y[0];
+    }
+
+    return (int)strlen(x) - (int)strlen(y);
+}
+
+/**
+ * Works out the syntax's table of character classes and the lengths of its
+ * comment delimiters, and sorts its keywords by first character and length
+ * for keyword_at, once.
+ */
+static void compile_syntax(syntax *s)
+{
+    if (s->keyword_len) {
+        return;
+    }
+
+    char const *delimiters[] = {s->single_line_comment_start,
+                                s->multiline_comment_start,
+                                s->multiline_comment_end};
+    int *lengths[] = {&s->scs_len, &s->mcs_len, &s->mce_len};
+    unsigned int j;
+
+    for (j = 0; j < sizeof(delimiters) / sizeof(delimiters[0]); ++j) {
+        *lengths[j] = delimiters[j] ? strlen(delimiters[j]) : 0;
+    }
+
+    int n = 0;
+    int c;
+
+    for (c = 0; c < 256; c++) {
+        s->classes[c] = is_separator(c) ? CC_SEPARATOR : 0;
+        if ((s->flags & HL_HIGHLIGHT_NUMBERS) && isdigit(c)) {
+            s->classes[c] |= CC_DIGIT;
+        }
+        if ((s->flags & HL_HIGHLIGHT_NUMBERS) && c == '.') {
+            s->classes[c] |= CC_DOT;
+        }
+        if ((s->flags & HL_HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) {
+            s->classes[c] |= CC_QUOTE;
+        }
+    }
+
+    if (s->scs_len) {
+        s->classes[(unsigned char)s->single_line_comment_start[0]] |=
+            CC_COMMENT;
+    }
+
+    if (s->mcs_len && s->mce_len) {
+        s->classes[(unsigned char)s->multiline_comment_start[0]] |=
+            CC_COMMENT;
+    }
+
+    while (s->keywords[n]) {
+        s->classes[(unsigned char)s->keywords[n][0]] |= CC_KEYWORD;
+        n++;
+    }
+
+#ifdef USE_SSE2
+    // runs of plain text can be scanned for the characters starting comments
+    // and strings, two of each at most, and for words following separators
+    // as long as the scan knows the separators and none can start a word
+    int stops = 0;
+
+    s->scan_runs = 1;
+
+    for (c = 0; c < 256; c++) {
+        if (s->classes[c] & (CC_COMMENT | CC_QUOTE)) {
+            if (stops == (int)sizeof(s->run_stops)) {
+                s->scan_runs = 0;
+                break;
+            }
+            s->run_stops[stops++] = c;
+        }
+        if ((s->classes[c] & CC_SEPARATOR) &&
+            (s->classes[c] & (CC_DIGIT | CC_KEYWORD))) {
+            s->scan_runs = 0;
+        }
+    }
+
+    // the slots left repeat a character that ends a run, or one no row has
+    for (j = stops; j < sizeof(s->run_stops); j++) {
+        s->run_stops[j] = stops ? s->run_stops[0] : '\n';
+    }
+
+    for (c = 0; c < 256; c += 16) {
+        unsigned char block[16];
+        unsigned int sep = 0;
+        int k;
+
+        for (k = 0; k < 16; k++) {
+            block[k] = c + k;
+            if (s->classes[c + k] & CC_SEPARATOR) {
+                sep |= 1 << k;
+            }
+        }
+
+        if (separator_lanes(_mm_loadu_si128((__m128i const *)block)) != sep) {
+            s->scan_runs = 0;
+        }
+    }
+#endif
+
+    qsort(s->keywords, n, sizeof(*s->keywords), compare_keywords);
+
+    s->keyword_len = malloc(n + 1);
+
+    if (!s->keyword_len) {
+        DIE("Failed to allocate memory");
+    }
+
+    int i;
+
+    s->keyword_max = 0;
+    c = 0;
+
+    for (i = 0; i < n; i++) {
+        int len = strlen(s->keywords[i]);
+
+        s->keyword_len[i] = len;
+        if (len > s->keyword_max) {
+            s->keyword_max = len;
+        }
+
+        while (c <= (unsigned char)s->keywords[i][0]) {
+            s->keyword_start[c++] = i;
+        }
+    }
+
+    while (c <= 256) {
+        s->keyword_start[c++] = n;
+    }
+}
+
+// syntaxes loaded from files at startup, looked up before the built in ones
+static syntax *loaded_syntaxes;
+static int num_loaded_syntaxes;
+
+#define SYNTAX_FILE_SUFFIX ".syntax"
+#define SYNTAX_WORD_SEPARATORS " \t\r\n"
+// longest name of a syntax, it gets shown in the status bar
+#define SYNTAX_NAME_MAX 32
+
+static char *copy_string(char const *s)
+{
+    size_t len = strlen(s);
+    char *copy = malloc(len + 1);
+
+    if (!copy) {
+        DIE("Failed to allocate memory");
+    }
+
+    memcpy(copy, s, len + 1);
+    return copy;
+}
+
+/**
+ * Appends copies of the blank separated words of the line to the NULL
+ * terminated list, which gets created if NULL, and returns the list.
+ */
+static char const **append_words(char const **list, char *line)
+{
+    int n = 0;
+
+    while (list && list[n]) {
+        n++;
+    }
+
+    char *word = line ? strtok(line, SYNTAX_WORD_SEPARATORS) : NULL;
+
+    do {
+        list = realloc(list, (n + 2) * sizeof(*list));
+
+        if (!list) {
+            DIE("Failed to allocate memory");
+        }
+
+        if (word) {
+            list[n++] = copy_string(word);
+        }
+        list[n] = NULL;
+    } while (word && (word = strtok(NULL, SYNTAX_WORD_SEPARATORS)));
+
+    return list;
+}
+
+static void free_words(char const **list)
+{
+    int n;
+
+    for (n = 0; list && list[n]; n++) {
+        free((char *)list[n]);
+    }
+    free(list);
+}
+
+static void free_syntax(syntax *s)
+{
+    free((char *)s->file_type);
+    free_words(s->file_match);
+    free_words(s->keywords);
+    free((char *)s->single_line_comment_start);
+    free((char *)s->multiline_comment_start);
+    free((char *)s->multiline_comment_end);
+}
+
+/**
+ * Reads a syntax definition into s, returns -1 with nothing kept if the file
+ * is not a valid one.
+ *
+ * Every line of the file is a key followed by its values, lines starting with
+ * # being ignored:
+ *
+ *   name Python
+ *   extensions .py .pyw
+ *   keywords def class if elif else return
+ *   comment #
+ *   multiline_comment """ """
+ *   numbers
+ *   strings
+ *
+ * keywords and extensions can be given over several lines.
+ */
+static int read_syntax_file(char const *path, syntax *s)
+{
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        LOG(WARN, "Failed to open syntax file %s", path);
+        return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+
+    char *line = NULL;
+    size_t cap = 0;
+    int line_number = 0;
+    int valid = 1;
+
+    while (valid && getline(&line, &cap, f) != -1) {
+        line_number++;
+
+        char *key = strtok(line, SYNTAX_WORD_SEPARATORS);
+
+        if (!key || key[0] == '#') {
+            continue;
+        }
+
+        // the rest of the line after the key
+        char *values = strtok(NULL, "");
+
+        if (strcmp(key, "extensions") == 0) {
+            s->file_match = append_words(s->file_match, values);
+            continue;
+        }
+
+        if (strcmp(key, "keywords") == 0) {
+            s->keywords = append_words(s->keywords, values);
+            continue;
+        }
+
+        char *first = values ? strtok(values, SYNTAX_WORD_SEPARATORS) : NULL;
+        char *second = first ? strtok(NULL, SYNTAX_WORD_SEPARATORS) : NULL;
+
+        if (strcmp(key, "name") == 0 && first) {
+            free((char *)s->file_type);
+            s->file_type = copy_string(first);
+        } else if (strcmp(key, "comment") == 0 && first) {
+            free((char *)s->single_line_comment_start);
+            s->single_line_comment_start = copy_string(first);
+        } else if (strcmp(key, "multiline_comment") == 0 && second) {
+            free((char *)s->multiline_comment_start);
+            free((char *)s->multiline_comment_end);
+            s->multiline_comment_start = copy_string(first);
+            s->multiline_comment_end = copy_string(second);
+        } else if (strcmp(key, "numbers") == 0) {
+            s->flags |= HL_HIGHLIGHT_NUMBERS;
+        } else if (strcmp(key, "strings") == 0) {
+            s->flags |= HL_HIGHLIGHT_STRINGS;
+        } else {
+            LOG(WARN, "%s:%d: invalid line", path, line_number);
+            valid = 0;
+        }
+    }
+
+    free(line);
+    fclose(f);
+
+    if (valid && (!s->file_type || !s->file_match || !s->file_match[0])) {
+        LOG(WARN, "%s: a syntax needs a name and extensions", path);
+        valid = 0;
+    }
+
+    if (valid && strlen(s->file_type) > SYNTAX_NAME_MAX) {
+        LOG(WARN, "%s: name too long", path);
+        valid = 0;
+    }
+
+    int i;
+
+    for (i = 0; valid && s->keywords && s->keywords[i]; i++) {
+        // keyword lengths are kept in a byte, see compile_syntax
+        if (strlen(s->keywords[i]) > 255) {
+            LOG(WARN, "%s: keyword too long", path);
+            valid = 0;
+        }
+    }
+
+    if (!valid) {
+        free_syntax(s);
+        return -1;
+    }
+
+    if (!s->keywords) {
+        s->keywords = append_words(NULL, NULL);
+    }
+
+    return 0;
+}
+
+static int is_syntax_file(struct dirent const *entry)
+{
+    size_t len = strlen(entry->d_name);
+    size_t suffix_len = strlen(SYNTAX_FILE_SUFFIX);
+
+    return len > suffix_len &&
+           strcmp(&entry->d_name[len - suffix_len], SYNTAX_FILE_SUFFIX) == 0;
+}
+
+void load_syntax_files(void)
+{
+    char dir[4096];
+    char const *config = getenv("XDG_CONFIG_HOME");
+    char const *home = getenv("HOME");
+
+    if (config && config[0]) {
+        snprintf(dir, sizeof(dir), "%s/steqs/syntax", config);
+    } else if (home && home[0]) {
+        snprintf(dir, sizeof(dir), "%s/.config/steqs/syntax", home);
+    } else {
+        return;
+    }
+
+    struct dirent **entries;
+    int n = scandir(dir, &entries, is_syntax_file, alphasort);
+
+    if (n < 0) {
+        return;
+    }
+
+    loaded_syntaxes = malloc((n ? n : 1) * sizeof(*loaded_syntaxes));
+
+    if (!loaded_syntaxes) {
+        DIE("Failed to allocate memory");
+    }
+
+    int i;
+
+    for (i = 0; i < n; i++) {
+        char path[sizeof(dir) + 256];
+
+        snprintf(path, sizeof(path), "%s/%s", dir, entries[i]->d_name);
+        if (read_syntax_file(path, &loaded_syntaxes[num_loaded_syntaxes]) ==
+            0) {
+            num_loaded_syntaxes++;
+        }
+        free(entries[i]);
+    }
+
+    free(entries);
+}
+
+static int syntax_matches(syntax const *s, char const *extension)
+{
+    int j;
+
+    for (j = 0; s->file_match[j]; j++) {
+        if (strcmp(extension, s->file_match[j]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the syntax of files with the given extension, those loaded from
+ * files taking precedence over the built in ones, or NULL.
+ */
+static syntax *find_syntax(char const *extension)
+{
+    int i;
+
+    for (i = 0; i < num_loaded_syntaxes; i++) {
+        if (syntax_matches(&loaded_syntaxes[i], extension)) {
+            return &loaded_syntaxes[i];
+        }
+    }
+
+    unsigned int j;
+
+    for (j = 0; j < HIGHLIGHT_DB_ENTRIES; ++j) {
+        if (syntax_matches(&HIGHLIGHT_DB[j], extension)) {
+            return &HIGHLIGHT_DB[j];
+        }
+    }
+
+    return NULL;
 }
 
 void select_syntax_highlight(void)
@@ -190,23 +954,25 @@ void select_syntax_highlight(void)
         return;
     }
 
-    unsigned int i;
-    for (i = 0; i < HIGHLIGHT_DB_ENTRIES; ++i) {
-        syntax *s = &HIGHLIGHT_DB[i];
-        unsigned int j = 0;
-        while (s->file_match[j]) {
-            if (strcmp(extension, s->file_match[j]) == 0) {
-                ec.syntax = s;
+    syntax *s = find_syntax(extension);
 
-                int row;
-                for (row = 0; row < ec.num_trows; ++row) {
-                    update_syntax(&ec.t_rows[row]);
-                }
+    if (!s) {
+        return;
+    }
 
-                return;
-            }
-            j++;
+    ec.syntax = s;
+    compile_syntax(s);
+
+    int row;
+    int open_comment = 0;
+    for (row = 0; row < ec.num_trows; ++row) {
+        text_row *tr = doc_get(&ec.doc, row);
+        // rows without a render get highlighted once shown
+        if (!tr->highlight || open_comment < 0) {
+            tr->highlight_open_comment = open_comment = -1;
+            continue;
         }
+        open_comment = update_syntax(tr, open_comment);
     }
 }
 
@@ -228,3 +994,16 @@ int syntax_to_color(int highlight)
             return 37; // white
     }
 }
+
+char const *syntax_to_sgr(int highlight)
+{
+    // built once per class instead of for every color change drawn
+    static char sgr[HL_KEYWORD + 1][8];
+
+    if (!sgr[highlight][0]) {
+        snprintf(sgr[highlight], sizeof(sgr[highlight]), "\x1b[%dm",
+                 syntax_to_color(highlight));
+    }
+
+    return sgr[highlight];
+}
@@ -1,6 +1,8 @@
 #ifndef INCLUDE_SRC_HIGHLIGHT_H_
 #define INCLUDE_SRC_HIGHLIGHT_H_
 
+#include <string.h>
+
 #include "editor.h"
 
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
@@ -16,10 +18,78 @@ enum highlight {
     HL_KEYWORD,
 };
 
+// bytes taken by the highlight of n columns, classes are packed two per byte
+// with the even column in the low half
+#define HL_BYTES(n) (((n) + 1) / 2)
+
+// the highlight starts at the render's first column
+static inline int text_row_hl(text_row const *tr, int i)
+{
+    i -= tr->render_start;
+    return (tr->highlight[i / 2] >> (i % 2 * 4)) & 0xf;
+}
+
+static inline void text_row_set_hl(text_row *tr, int i, int hl)
+{
+    i -= tr->render_start;
+    unsigned char *b = &tr->highlight[i / 2];
+    *b = (*b & (0xf0 >> (i % 2 * 4))) | (hl << (i % 2 * 4));
+}
+
+/**
+ * Sets the highlight of the columns in [from, to).
+ */
+static inline void text_row_fill_hl(text_row *tr, int from, int to, int hl)
+{
+    int start = tr->render_start;
+
+    if (from < to && (from - start) % 2) {
+        text_row_set_hl(tr, from++, hl);
+    }
+
+    int bytes = (to - from) / 2;
+
+    if (bytes > 0) {
+        memset(&tr->highlight[(from - start) / 2], hl * 0x11, bytes);
+        from += bytes * 2;
+    }
+
+    if (from < to) {
+        text_row_set_hl(tr, from, hl);
+    }
+}
+
+/**
+ * Loads the syntax definitions of the *.syntax files in
+ * $XDG_CONFIG_HOME/steqs/syntax, or ~/.config/steqs/syntax, which highlight
+ * the files they match instead of the built in ones. Files that are not valid
+ * definitions get logged and skipped.
+ */
+void load_syntax_files(void);
+
 void select_syntax_highlight(void);
 
-void update_syntax(text_row *tr);
+/**
+ * Highlights the given row, open_comment telling whether the row before it
+ * ends inside a multiline comment. Returns whether the row itself does.
+ *
+ * An open_comment of -1 tells that the row before it was not highlighted yet,
+ * the row is then left plain and -1 is returned.
+ */
+int update_syntax(text_row *tr, int open_comment);
+
+/**
+ * Highlights the row again after its render changed in [from, to) only, the
+ * highlight of the rest of the row having been shifted into place.
+ */
+int update_syntax_span(text_row *tr, int open_comment, int from, int to);
 
 int syntax_to_color(int highlight);
 
+/**
+ * Returns the escape sequence switching the foreground to the color of the
+ * given highlight class.
+ */
+char const *syntax_to_sgr(int highlight);
+
 #endif // INCLUDE_SRC_HIGHLIGHT_H_
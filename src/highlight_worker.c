@@ -0,0 +1,240 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <string.h>
+
+#include "editor.h"
+#include "event.h"
+#include "highlight.h"
+#include "highlight_worker.h"
+#include "util.h"
+
+// a row handed to the worker, its content either still in the mapped file or
+// copied into the copies of the batch at the given offset
+typedef struct {
+    char const *content;
+    long copied;
+    int size;
+} posted_row;
+
+static struct {
+    int started;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t posted;
+    pthread_cond_t idle;
+    // the batch of rows being worked on, and the states they end with
+    posted_row *rows;
+    int cap;
+    int n;
+    int open_comment;
+    char *copies;
+    long copies_len;
+    long copies_cap;
+    unsigned char *states;
+    // set from when rows get posted until the worker is done with them
+    int busy;
+    // set once the states are ready, until taken
+    int done;
+    int cancel;
+} worker = {.lock = PTHREAD_MUTEX_INITIALIZER,
+            .posted = PTHREAD_COND_INITIALIZER,
+            .idle = PTHREAD_COND_INITIALIZER};
+
+/**
+ * Works out the states the rows of the batch end with, returns whether it got
+ * through all of them before being told to stop.
+ */
+static int highlight_batch(text_row *tr, int *cap)
+{
+    int open_comment = worker.open_comment;
+    int i;
+
+    for (i = 0; i < worker.n; i++) {
+        posted_row *row = &worker.rows[i];
+
+        pthread_mutex_lock(&worker.lock);
+        int cancel = worker.cancel;
+        pthread_mutex_unlock(&worker.lock);
+
+        if (cancel) {
+            return 0;
+        }
+
+        // long rows are taken to neither start nor end a multiline comment,
+        // see highlight_through
+        if (row->size <= LONG_ROW_SIZE) {
+            if (HL_BYTES(row->size) + 1 > *cap) {
+                *cap = HL_BYTES(row->size) + 1;
+                tr->highlight = realloc(tr->highlight, *cap);
+                if (!tr->highlight) {
+                    DIE("Failed to allocate memory");
+                }
+            }
+
+            // tabs make no difference to the states, the content is
+            // highlighted as is instead of its render
+            tr->to_render = (char *)row->content;
+            tr->size = row->size;
+            tr->render_size = row->size;
+            open_comment = update_syntax(tr, open_comment);
+        }
+
+        worker.states[i] = open_comment;
+    }
+
+    return 1;
+}
+
+static void *highlight_posted(void *arg)
+{
+    (void)arg;
+
+    text_row tr;
+    int cap = 0;
+
+    memset(&tr, 0, sizeof(tr));
+
+    pthread_mutex_lock(&worker.lock);
+
+    while (1) {
+        while (!worker.busy) {
+            pthread_cond_wait(&worker.posted, &worker.lock);
+        }
+        pthread_mutex_unlock(&worker.lock);
+
+        int done = highlight_batch(&tr, &cap);
+
+        pthread_mutex_lock(&worker.lock);
+        worker.busy = 0;
+        worker.done = done && !worker.cancel;
+        worker.cancel = 0;
+        pthread_cond_signal(&worker.idle);
+
+        if (worker.done) {
+            event_wake();
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Makes room for n rows and len bytes of copies in the batch.
+ */
+static void reserve_batch(int n, long len)
+{
+    if (n > worker.cap) {
+        worker.cap = n;
+        worker.rows = realloc(worker.rows, sizeof(posted_row) * n);
+        worker.states = realloc(worker.states, n);
+        if (!worker.rows || !worker.states) {
+            DIE("Failed to allocate memory");
+        }
+    }
+
+    if (len > worker.copies_cap) {
+        worker.copies_cap = worker.copies_cap ? worker.copies_cap : 4096;
+        while (worker.copies_cap < len) {
+            worker.copies_cap *= 2;
+        }
+        worker.copies = realloc(worker.copies, worker.copies_cap);
+        if (!worker.copies) {
+            DIE("Failed to allocate memory");
+        }
+    }
+}
+
+void highlight_worker_post(int first, int n, int open_comment)
+{
+    if (!worker.started) {
+        if (pthread_create(&worker.thread, NULL, highlight_posted, NULL) != 0) {
+            DIE("Failed to start highlighting");
+        }
+        worker.started = 1;
+    }
+
+    // the worker only looks at the batch once told to, below
+    reserve_batch(n, 0);
+    worker.copies_len = 0;
+
+    int i;
+
+    for (i = 0; i < n; i++) {
+        text_row *tr = doc_peek(&ec.doc, first + i);
+        posted_row *row = &worker.rows[i];
+
+        row->size = tr->size;
+
+        // the mapped file does not change under the worker, edited rows do
+        // and get copied unless empty
+        if ((tr->flags & ROW_MAPPED) || !tr->size) {
+            row->content = tr->content;
+            continue;
+        }
+
+        int after = tr->size - tr->gap_start;
+
+        reserve_batch(n, worker.copies_len + tr->size);
+        row->content = NULL;
+        row->copied = worker.copies_len;
+        memcpy(&worker.copies[worker.copies_len], tr->content, tr->gap_start);
+        memcpy(&worker.copies[worker.copies_len + tr->gap_start],
+               &tr->content[tr->gap_start + tr->gap_len], after);
+        worker.copies_len += tr->size;
+    }
+
+    // the copies are in place for good now
+    for (i = 0; i < n; i++) {
+        if (!worker.rows[i].content) {
+            worker.rows[i].content = &worker.copies[worker.rows[i].copied];
+        }
+    }
+
+    pthread_mutex_lock(&worker.lock);
+    worker.n = n;
+    worker.open_comment = open_comment;
+    worker.busy = 1;
+    worker.done = 0;
+    worker.cancel = 0;
+    pthread_cond_signal(&worker.posted);
+    pthread_mutex_unlock(&worker.lock);
+}
+
+int highlight_worker_busy(void)
+{
+    pthread_mutex_lock(&worker.lock);
+    int busy = worker.busy;
+    pthread_mutex_unlock(&worker.lock);
+
+    return busy;
+}
+
+unsigned char const *highlight_worker_take(void)
+{
+    pthread_mutex_lock(&worker.lock);
+    int done = worker.done;
+    worker.done = 0;
+    pthread_mutex_unlock(&worker.lock);
+
+    return done ? worker.states : NULL;
+}
+
+void highlight_worker_cancel(void)
+{
+    pthread_mutex_lock(&worker.lock);
+    worker.cancel = worker.busy;
+    worker.done = 0;
+    pthread_mutex_unlock(&worker.lock);
+}
+
+void highlight_worker_stop(void)
+{
+    pthread_mutex_lock(&worker.lock);
+    worker.cancel = worker.busy;
+    worker.done = 0;
+    while (worker.busy) {
+        pthread_cond_wait(&worker.idle, &worker.lock);
+    }
+    pthread_mutex_unlock(&worker.lock);
+}
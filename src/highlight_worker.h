@@ -0,0 +1,36 @@
+#ifndef INCLUDE_SRC_HIGHLIGHT_WORKER_H_
+#define INCLUDE_SRC_HIGHLIGHT_WORKER_H_
+
+/**
+ * Hands the worker thread the n rows from position first on, following a row
+ * ending with the given multiline comment state, to find out the states they
+ * end with. The rows are read right away and can be edited afterwards. Only
+ * one batch of rows is worked on at a time: nothing can be posted while the
+ * worker is busy.
+ */
+void highlight_worker_post(int first, int n, int open_comment);
+
+/**
+ * Returns whether rows posted are still being worked on.
+ */
+int highlight_worker_busy(void);
+
+/**
+ * Returns the states of the rows posted last once the worker is done with
+ * them, NULL while it is not or if they were taken already or dropped. The
+ * states stay valid until rows get posted again.
+ */
+unsigned char const *highlight_worker_take(void);
+
+/**
+ * Drops the rows posted, the worker lets go of them as soon as it can.
+ */
+void highlight_worker_cancel(void);
+
+/**
+ * Drops the rows posted and waits for the worker to let go of them, before
+ * the file they come from or its syntax go away.
+ */
+void highlight_worker_stop(void);
+
+#endif // INCLUDE_SRC_HIGHLIGHT_WORKER_H_
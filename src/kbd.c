@@ -1,57 +1,225 @@
+#define _DEFAULT_SOURCE
+
+#include "append_buffer.h"
+#include "event.h"
 #include "kbd.h"
+#include "loader.h"
+#include "screen.h"
 #include "util.h"
 
 #include <errno.h>
+#include <poll.h>
+#include <string.h>
 #include <unistd.h>
 
-int read_key(void)
+// what terminals in bracketed paste mode send after the text pasted
+#define PASTE_END "\x1b[201~"
+#define PASTE_END_LEN 6
+
+// milliseconds the rest of an escape sequence is waited for, nothing comes
+// after the escape key pressed on its own
+#define ESCAPE_TIMEOUT 100
+
+// bytes read from the terminal that are not keys yet, a ring whose head and
+// tail only ever grow
+static struct {
+    char buf[KBD_BUFFER_SIZE];
+    unsigned int head;
+    unsigned int tail;
+} input;
+
+// text of the last paste
+static abuf paste = ABUF_INIT;
+
+/**
+ * Reads as much of the input there is as fits after the tail of the ring,
+ * returns whether there was any.
+ */
+static int fill_input(void)
 {
-    int read_res;
-    char c;
+    unsigned int at = input.tail % KBD_BUFFER_SIZE;
+    unsigned int room = KBD_BUFFER_SIZE - (input.tail - input.head);
+
+    if (room > KBD_BUFFER_SIZE - at) {
+        room = KBD_BUFFER_SIZE - at;
+    }
 
-    while ((read_res = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (read_res == -1) {
-            if (errno == EINTR) {
-                // keep going on interruption when handling signal (SIGWINCH)
-                ;
-            } else if (errno != EAGAIN) {
-                DIE("read: Unable to read input");
+    if (!room) {
+        return 0;
+    }
+
+    ssize_t read_res = read(STDIN_FILENO, &input.buf[at], room);
+
+    if (read_res == -1 && errno != EINTR && errno != EAGAIN) {
+        DIE("read: Unable to read input");
+    }
+
+    if (read_res <= 0) {
+        return 0;
+    }
+
+    input.tail += read_res;
+    return 1;
+}
+
+/**
+ * Waits for input for at most timeout milliseconds, for as long as it takes
+ * if negative, keeping the screen up to date in the meantime.
+ * Returns whether input came.
+ */
+static int wait_input(int timeout)
+{
+    while (1) {
+        int events = event_wait(timeout);
+
+        if (events & EVENT_WAKE) {
+            int resized = take_win_resize();
+            int highlighted = highlight_poll();
+            if (loader_poll() || resized || highlighted) {
+                refresh_screen();
             }
         }
+
+        // the frame skipped while the terminal was busy gets drawn once it
+        // took in the earlier ones
+        if ((events & EVENT_OUTPUT) && screen_drain()) {
+            refresh_screen();
+        }
+
+        if ((events & EVENT_INPUT) && fill_input()) {
+            return 1;
+        }
+
+        if (!events) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Takes the next byte of input, waiting for it as wait_input does. Returns
+ * whether there was one.
+ */
+static int next_byte(char *c, int timeout)
+{
+    if (input.head == input.tail && !wait_input(timeout)) {
+        return 0;
+    }
+
+    *c = input.buf[input.head++ % KBD_BUFFER_SIZE];
+    return 1;
+}
+
+/**
+ * Takes the text pasted up to the sequence that ends it. The text goes over
+ * in runs up to the next ~, the last byte of the sequence.
+ */
+static void read_paste(void)
+{
+    buf_clear(&paste);
+
+    while (1) {
+        if (input.head == input.tail) {
+            wait_input(-1);
+        }
+
+        unsigned int at = input.head % KBD_BUFFER_SIZE;
+        unsigned int n = input.tail - input.head;
+
+        if (n > KBD_BUFFER_SIZE - at) {
+            n = KBD_BUFFER_SIZE - at;
+        }
+
+        char const *end = memchr(&input.buf[at], '~', n);
+
+        if (end) {
+            n = end - &input.buf[at] + 1;
+        }
+
+        buf_append(&paste, &input.buf[at], n);
+        input.head += n;
+
+        if (end && paste.len >= PASTE_END_LEN &&
+            memcmp(&paste.buf[paste.len - PASTE_END_LEN], PASTE_END,
+                   PASTE_END_LEN) == 0) {
+            paste.len -= PASTE_END_LEN;
+            return;
+        }
+    }
+}
+
+char const *pasted_text(size_t *len)
+{
+    *len = paste.len;
+    return paste.buf;
+}
+
+int key_pending(void)
+{
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+    // top up the ring with whatever the terminal already has
+    if (input.tail - input.head < KBD_BUFFER_SIZE && poll(&pfd, 1, 0) == 1) {
+        fill_input();
+    }
+
+    return input.head != input.tail;
+}
+
+int read_key(void)
+{
+    char c;
+
+    // a wait with no timeout should not end without input, should it anyway
+    // nothing is taken for a key and the input is waited for again
+    while (!next_byte(&c, -1)) {
     }
 
     if (c == '\x1b') {
         char seq[3];
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) {
+        if (!next_byte(&seq[0], ESCAPE_TIMEOUT)) {
             return '\x1b';
         }
 
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) {
+        if (!next_byte(&seq[1], ESCAPE_TIMEOUT)) {
             return '\x1b';
         }
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) {
-                    return '\x1b';
+                // the number up to the ~
+                int n = seq[1] - '0';
+                while (1) {
+                    if (!next_byte(&seq[2], ESCAPE_TIMEOUT)) {
+                        return '\x1b';
+                    }
+                    if (seq[2] < '0' || seq[2] > '9') {
+                        break;
+                    }
+                    if (n < 1000) {
+                        n = n * 10 + seq[2] - '0';
+                    }
                 }
                 if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1':
+                    switch (n) {
+                        case 1:
                             return HOME;
-                        case '4':
+                        case 4:
                             return END;
-                        case '3':
+                        case 3:
                             return DEL;
-                        case '5':
+                        case 5:
                             return PAGE_UP;
-                        case '6':
+                        case 6:
                             return PAGE_DOWN;
-                        case '7':
+                        case 7:
                             return HOME;
-                        case '8':
+                        case 8:
                             return END;
+                        case 200:
+                            read_paste();
+                            return PASTE;
                     }
                 }
             } else {
@@ -1,6 +1,11 @@
 #ifndef INCLUDE_SRC_KBD_H_
 #define INCLUDE_SRC_KBD_H_
 
+#include <stddef.h>
+
+// input read ahead of the keys handled, a power of two
+#define KBD_BUFFER_SIZE 4096
+
 enum keys {
     BACKSPACE = 127,
     ARROW_LEFT = 1000,
@@ -11,9 +16,23 @@ enum keys {
     PAGE_DOWN,
     HOME,
     END,
-    DEL
+    DEL,
+    // text pasted at once, see pasted_text
+    PASTE
 };
 
 int read_key(void);
 
+/**
+ * Returns the text that came with the last PASTE key read, setting len to its
+ * length. It is only valid until the next key is read.
+ */
+char const *pasted_text(size_t *len);
+
+/**
+ * Returns whether input is already there for read_key to take without
+ * waiting.
+ */
+int key_pending(void);
+
 #endif // INCLUDE_SRC_KBD_H_
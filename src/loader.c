@@ -0,0 +1,274 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "editor.h"
+#include "event.h"
+#include "loader.h"
+#include "util.h"
+
+// leaves the worker indexes before handing them over, the first batches are
+// smaller so the first screen does not wait for a full one
+#define LOADER_BATCH 1024
+// milliseconds between the UI being woken up to show the rows indexed
+#define LOADER_WAKE_INTERVAL 50
+
+typedef struct {
+    long first;
+    long bytes;
+} indexed_leaf;
+
+static struct {
+    int busy;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    // every full leaf indexed so far, the ones before taken are already in
+    // the document
+    indexed_leaf *leaves;
+    int num_leaves;
+    int cap;
+    int taken;
+    size_t scanned;
+    // set once the whole file is indexed, with the trailing lines that do not
+    // fill a leaf
+    int done;
+    int stop;
+    long tail_first;
+    int tail_lines;
+    long tail_bytes;
+    // when the worker last woke the UI up
+    long woken;
+} loader = {.lock = PTHREAD_MUTEX_INITIALIZER,
+              .ready = PTHREAD_COND_INITIALIZER};
+
+/**
+ * Returns the time in milliseconds, counted from an arbitrary point.
+ */
+static long clock_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Hands a batch of indexed leaves over to the UI thread, returns whether to
+ * keep going.
+ */
+static int publish(indexed_leaf *batch, int n, size_t scanned)
+{
+    pthread_mutex_lock(&loader.lock);
+
+    if (loader.num_leaves + n > loader.cap) {
+        loader.cap = loader.cap ? loader.cap * 2 : LOADER_BATCH;
+        while (loader.cap < loader.num_leaves + n) {
+            loader.cap *= 2;
+        }
+        loader.leaves = realloc(loader.leaves, sizeof(indexed_leaf) * loader.cap);
+        if (!loader.leaves) {
+            DIE("Failed to allocate memory");
+        }
+    }
+
+    // the last batch of a small file may hold no leaf, with none allocated
+    if (n > 0) {
+        memcpy(&loader.leaves[loader.num_leaves], batch,
+               sizeof(indexed_leaf) * n);
+        loader.num_leaves += n;
+    }
+    loader.scanned = scanned;
+
+    int stop = loader.stop;
+
+    pthread_cond_signal(&loader.ready);
+    pthread_mutex_unlock(&loader.lock);
+
+    // the UI sleeps until told there are rows to show, it is not told more
+    // often than it is worth drawing them
+    long now = clock_ms();
+    if (now - loader.woken >= LOADER_WAKE_INTERVAL) {
+        loader.woken = now;
+        event_wake();
+    }
+
+    return !stop;
+}
+
+static void *index_lines(void *arg)
+{
+    (void)arg;
+
+    static indexed_leaf batch[LOADER_BATCH];
+    int n = 0;
+    int limit = 1;
+
+    char const *p = ec.map;
+    char const *end = ec.map + ec.map_size;
+    char const *released = p;
+    long first = 0;
+    int lines = 0;
+    long bytes = 0;
+
+    while (p < end) {
+        char const *nl = memchr(p, '\n', end - p);
+        long len = (nl ? nl : end) - p;
+
+        // rows get loaded without their carriage returns
+        while (len > 0 && p[len - 1] == '\r') {
+            len--;
+        }
+
+        bytes += len + 1;
+        p = nl ? nl + 1 : end;
+
+        if (++lines < DOC_LEAF_ROWS) {
+            continue;
+        }
+
+        batch[n].first = first;
+        batch[n++].bytes = bytes;
+        first = p - ec.map;
+        lines = 0;
+        bytes = 0;
+
+        if (n == limit) {
+            int more = publish(batch, n, first);
+            n = 0;
+            // the pages scanned are not needed again unless shown
+            if (ec.read_only) {
+                release_mapped(released, p);
+                released = p;
+            }
+            if (!more) {
+                break;
+            }
+            if (limit < LOADER_BATCH) {
+                limit *= 2;
+            }
+        }
+    }
+
+    publish(batch, n, ec.map_size);
+
+    pthread_mutex_lock(&loader.lock);
+    loader.tail_first = first;
+    loader.tail_lines = lines;
+    loader.tail_bytes = bytes;
+    loader.done = 1;
+    pthread_cond_signal(&loader.ready);
+    pthread_mutex_unlock(&loader.lock);
+
+    event_wake();
+
+    return NULL;
+}
+
+/**
+ * Joins the finished worker and gets ready for the next file.
+ */
+static void reset(void)
+{
+    pthread_join(loader.thread, NULL);
+    FREE(loader.leaves);
+    loader.num_leaves = 0;
+    loader.cap = 0;
+    loader.taken = 0;
+    loader.scanned = 0;
+    loader.done = 0;
+    loader.stop = 0;
+    loader.busy = 0;
+}
+
+void loader_start(void)
+{
+    loader.busy = 1;
+
+    if (pthread_create(&loader.thread, NULL, index_lines, NULL) != 0) {
+        DIE("Failed to start loading file");
+    }
+
+    pthread_mutex_lock(&loader.lock);
+    while (!loader.num_leaves && !loader.done) {
+        pthread_cond_wait(&loader.ready, &loader.lock);
+    }
+    pthread_mutex_unlock(&loader.lock);
+
+    loader_poll();
+}
+
+int loader_poll(void)
+{
+    if (!loader.busy) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&loader.lock);
+    int added = loader.num_leaves - loader.taken;
+    for (; loader.taken < loader.num_leaves; loader.taken++) {
+        doc_append_lazy(&ec.doc, loader.leaves[loader.taken].first,
+                        DOC_LEAF_ROWS, loader.leaves[loader.taken].bytes);
+    }
+    // everything was published before done got set
+    int done = loader.done;
+    pthread_mutex_unlock(&loader.lock);
+
+    if (done) {
+        if (loader.tail_lines) {
+            doc_append_lazy(&ec.doc, loader.tail_first, loader.tail_lines,
+                            loader.tail_bytes);
+        }
+        reset();
+    }
+
+    ec.num_trows = ec.doc.num_rows;
+
+    return added || done;
+}
+
+void loader_finish(void)
+{
+    if (!loader.busy) {
+        return;
+    }
+
+    pthread_mutex_lock(&loader.lock);
+    while (!loader.done) {
+        pthread_cond_wait(&loader.ready, &loader.lock);
+    }
+    pthread_mutex_unlock(&loader.lock);
+
+    loader_poll();
+}
+
+void loader_stop(void)
+{
+    if (!loader.busy) {
+        return;
+    }
+
+    pthread_mutex_lock(&loader.lock);
+    loader.stop = 1;
+    while (!loader.done) {
+        pthread_cond_wait(&loader.ready, &loader.lock);
+    }
+    pthread_mutex_unlock(&loader.lock);
+
+    reset();
+}
+
+int loader_progress(void)
+{
+    if (!loader.busy) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&loader.lock);
+    int percent = loader.scanned * 100 / ec.map_size;
+    pthread_mutex_unlock(&loader.lock);
+
+    return percent;
+}
@@ -0,0 +1,32 @@
+#ifndef INCLUDE_SRC_LOADER_H_
+#define INCLUDE_SRC_LOADER_H_
+
+/**
+ * Starts indexing the lines of the mapped file on a worker thread, returns
+ * once the first rows are ready to be shown.
+ */
+void loader_start(void);
+
+/**
+ * Appends the rows indexed since the last call to the document, returns
+ * whether there were any.
+ */
+int loader_poll(void);
+
+/**
+ * Waits for the whole file to be loaded into the document.
+ */
+void loader_finish(void);
+
+/**
+ * Stops loading, the rows not loaded yet are left out of the document.
+ */
+void loader_stop(void);
+
+/**
+ * Returns the percentage of the file loaded so far, or -1 if no file is being
+ * loaded.
+ */
+int loader_progress(void);
+
+#endif // INCLUDE_SRC_LOADER_H_
@@ -1,19 +1,62 @@
 #include "editor.h"
+#include "event.h"
+#include "highlight.h"
+#include "kbd.h"
+#include "loader.h"
+#include "status_bar.h"
 #include <signal.h>
+#include <string.h>
 
 int main(int argc, char *argv[])
 {
+    event_init();
     signal(SIGWINCH, handle_win_resize);
 
     init_editor();
+    load_syntax_files();
 
-    if (argc >= 2) {
-        open_file(argv[1]);
+    char *filename = NULL;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-R") == 0) {
+            // view only: nothing gets edited and only the rows around the
+            // screen stay in memory
+            ec.read_only = 1;
+            set_status_msg("Help: ^q Quit | ^f Find | ^g Go to | ^w Wrap");
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if (filename) {
+        open_file(filename);
     }
 
     while (1) {
         refresh_screen();
-        process_key();
+
+        // rows the highlight worker got done with are shown right away, it
+        // goes on with the next ones while waiting
+        if (highlight_poll()) {
+            continue;
+        }
+
+        // sleep until a key, a resize, rows loaded or highlighted in the
+        // background, which all get taken in before the next frame
+        int events = event_wait(-1);
+
+        if (events & EVENT_WAKE) {
+            take_win_resize();
+            loader_poll();
+        }
+
+        // keys that came in while the frame was drawn are all handled before
+        // drawing the next one, the view following the cursor after each
+        while (key_pending()) {
+            process_key();
+            scroll();
+        }
     }
 
     return EXIT_SUCCESS;
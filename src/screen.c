@@ -0,0 +1,349 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "append_buffer.h"
+#include "event.h"
+#include "screen.h"
+#include "util.h"
+
+static struct {
+    // bytes drawn for every line of the last frame written, if written
+    abuf *lines;
+    int *written;
+    int num_lines;
+    int cols;
+    int cursor_row;
+    int cursor_col;
+    // lines of the frame being built that need to be written, kept from one
+    // frame to the next
+    abuf changed;
+    // output the terminal has not taken yet, from sent on
+    abuf out;
+    size_t sent;
+    int skipped;
+    screen_stats stats;
+} screen;
+
+/**
+ * Writes as much of the output left as the terminal takes, returns whether
+ * all of it is written.
+ */
+static int flush(void)
+{
+    while (screen.sent < screen.out.len) {
+        ssize_t n = write(STDOUT_FILENO, &screen.out.buf[screen.sent],
+                          screen.out.len - screen.sent);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // carry on once the terminal can take more
+            event_watch_output(1);
+            return 0;
+        }
+
+        if (n == -1) {
+            // nothing written can be shown, it is dropped
+            break;
+        }
+
+        screen.sent += n;
+    }
+
+    buf_clear(&screen.out);
+    screen.sent = 0;
+    event_watch_output(0);
+    return 1;
+}
+
+int screen_ready(void)
+{
+    if (flush()) {
+        screen.skipped = 0;
+        return 1;
+    }
+
+    if (!screen.skipped) {
+        screen.skipped = 1;
+        screen.stats.skipped++;
+    }
+
+    return 0;
+}
+
+int screen_drain(void)
+{
+    return flush() && screen.skipped;
+}
+
+void screen_write(char const *s, size_t len)
+{
+    buf_append(&screen.out, s, len);
+    flush();
+}
+
+void screen_sync(void)
+{
+    flush();
+}
+
+void screen_invalidate(void)
+{
+    int i;
+
+    for (i = 0; i < screen.num_lines; i++) {
+        buf_free(&screen.lines[i]);
+    }
+
+    FREE(screen.lines);
+    FREE(screen.written);
+    screen.num_lines = 0;
+}
+
+void screen_begin(int num_lines, int cols)
+{
+    if (num_lines != screen.num_lines || cols != screen.cols) {
+        screen_invalidate();
+
+        screen.lines = calloc(num_lines, sizeof(abuf));
+        screen.written = calloc(num_lines, sizeof(int));
+        if (!screen.lines || !screen.written) {
+            DIE("Failed to allocate memory");
+        }
+
+        screen.num_lines = num_lines;
+        screen.cols = cols;
+    }
+
+    buf_clear(&screen.changed);
+}
+
+/**
+ * Reverses the order of the lines in [from, to].
+ */
+static void reverse_lines(int from, int to)
+{
+    for (; from < to; from++, to--) {
+        abuf line = screen.lines[from];
+        int written = screen.written[from];
+
+        screen.lines[from] = screen.lines[to];
+        screen.written[from] = screen.written[to];
+        screen.lines[to] = line;
+        screen.written[to] = written;
+    }
+}
+
+void screen_scroll(int top, int bottom, int by)
+{
+    int height = bottom - top + 1;
+    int n = by < 0 ? -by : by;
+    int i;
+
+    if (!by || n >= height) {
+        return;
+    }
+
+    // nothing to move on a screen that is about to be written in full
+    i = top;
+    while (i <= bottom && !screen.written[i]) {
+        i++;
+    }
+    if (i > bottom) {
+        return;
+    }
+
+    // scroll within a region of the lines, then make the whole screen the
+    // region again
+    char seq[48];
+    int len = snprintf(seq, sizeof(seq), "\x1b[%d;%dr\x1b[%d%c\x1b[r", top + 1,
+                       bottom + 1, n, by > 0 ? 'S' : 'T');
+    buf_append(&screen.changed, seq, len);
+
+    // the lines scrolled out of view make room for the blank ones scrolled
+    // in, at the other end, and hand them their buffers
+    int split = by > 0 ? top + n - 1 : bottom - n;
+    int blank = by > 0 ? bottom - n + 1 : top;
+
+    reverse_lines(top, split);
+    reverse_lines(split + 1, bottom);
+    reverse_lines(top, bottom);
+
+    for (i = blank; i < blank + n; i++) {
+        buf_clear(&screen.lines[i]);
+        screen.written[i] = 1;
+    }
+}
+
+/**
+ * Returns where the byte c leaves the escape sequence being read: 0 outside of
+ * one, 1 after its escape byte and 2 inside a control sequence, which ends with
+ * a byte from @ to ~.
+ */
+static int escape_state(int state, unsigned char c)
+{
+    if (state == 1) {
+        return 2;
+    }
+
+    if (state == 2) {
+        return c >= '@' && c <= '~' ? 0 : 2;
+    }
+
+    return c == '\x1b';
+}
+
+/**
+ * Returns the number of columns the len bytes drawn take, or -1 if they hold
+ * anything but printable ASCII characters and escape sequences.
+ */
+static int columns(char const *s, size_t len)
+{
+    int cols = 0;
+    int state = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        int was = state;
+
+        state = escape_state(state, c);
+        if (was || state) {
+            continue;
+        }
+        if (c < ' ' || c > '~') {
+            return -1;
+        }
+        cols++;
+    }
+
+    return cols;
+}
+
+/**
+ * Returns how many bytes at the start of the line are the same as in the last
+ * one written there, leaving out an escape sequence cut short.
+ */
+static size_t same_start(abuf const *last, abuf const *line)
+{
+    size_t n = last->len < line->len ? last->len : line->len;
+    size_t same = 0;
+    int state = 0;
+    size_t i;
+
+    for (i = 0; i < n && last->buf[i] == line->buf[i]; i++) {
+        state = escape_state(state, line->buf[i]);
+        if (!state) {
+            same = i + 1;
+        }
+    }
+
+    return same;
+}
+
+/**
+ * Appends the escape sequences among the first len bytes drawn.
+ */
+static void append_escapes(abuf *buf, char const *s, size_t len)
+{
+    size_t start = 0;
+    int state = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        int was = state;
+
+        state = escape_state(state, s[i]);
+        if (!was && state) {
+            start = i;
+        } else if (was && !state) {
+            buf_append(buf, &s[start], i + 1 - start);
+        }
+    }
+}
+
+void screen_line(int at, abuf *line)
+{
+    abuf *last = &screen.lines[at];
+
+    if (screen.written[at] && last->len == line->len &&
+        (!line->len || memcmp(last->buf, line->buf, line->len) == 0)) {
+        buf_clear(line);
+        return;
+    }
+
+    size_t same = screen.written[at] ? same_start(last, line) : 0;
+    int col = same ? columns(line->buf, same) : -1;
+    int last_rest = columns(&last->buf[same], last->len - same);
+    int rest = columns(&line->buf[same], line->len - same);
+    char move[32];
+    int len;
+
+    if (col > 0 && last_rest >= 0 && rest >= 0) {
+        // only draw from the first column that changed, in the attributes
+        // the line has there
+        len = snprintf(move, sizeof(move), "\x1b[%d;%dH\x1b[m", at + 1,
+                       col + 1);
+        buf_append(&screen.changed, move, len);
+        append_escapes(&screen.changed, line->buf, same);
+        buf_append(&screen.changed, &line->buf[same], line->len - same);
+        // erase what is left of a longer line
+        if (rest < last_rest) {
+            buf_append(&screen.changed, "\x1b[K", 3);
+        }
+    } else {
+        // move to the start of the line and erase it before drawing it,
+        // erasing after it would also take the last column of a full line
+        len = snprintf(move, sizeof(move), "\x1b[%d;1H\x1b[2K", at + 1);
+        buf_append(&screen.changed, move, len);
+        buf_append(&screen.changed, line->buf, line->len);
+    }
+
+    screen.written[at] = 1;
+
+    // the line drawn before takes the place of the new one, for the next
+    // line to be drawn into
+    abuf drawn = *last;
+    *last = *line;
+    *line = drawn;
+    buf_clear(line);
+}
+
+void screen_end(int r, int c)
+{
+    size_t start = screen.out.len;
+
+    if (screen.changed.len) {
+        // hide the cursor while drawing to get rid of flickering
+        buf_append(&screen.out, "\x1b[?25l", 6);
+        buf_append(&screen.out, screen.changed.buf, screen.changed.len);
+    }
+
+    if (screen.changed.len || r != screen.cursor_row ||
+        c != screen.cursor_col) {
+        char move[32];
+        int len = snprintf(move, sizeof(move), "\x1b[%d;%dH", r, c);
+        buf_append(&screen.out, move, len);
+    }
+
+    if (screen.changed.len) {
+        buf_append(&screen.out, "\x1b[?25h", 6);
+    }
+
+    screen.cursor_row = r;
+    screen.cursor_col = c;
+    screen.stats.frames++;
+    screen.stats.bytes += screen.out.len - start;
+    screen.stats.frame_bytes = screen.out.len - start;
+
+    flush();
+}
+
+screen_stats screen_get_stats(void)
+{
+    return screen.stats;
+}
@@ -0,0 +1,75 @@
+#ifndef INCLUDE_SRC_SCREEN_H_
+#define INCLUDE_SRC_SCREEN_H_
+
+#include "append_buffer.h"
+
+/**
+ * Returns whether the terminal took in everything written so far, so a new
+ * frame can be drawn. If not, the frame is skipped: it would be stale by the
+ * time the terminal gets to it.
+ */
+int screen_ready(void);
+
+/**
+ * Writes what the terminal takes of the output left, without waiting.
+ * Returns whether a frame was skipped that can be drawn now that it is all
+ * written.
+ */
+int screen_drain(void);
+
+/**
+ * Queues bytes for the terminal after the frames, for it to take as it can.
+ */
+void screen_write(char const *s, size_t len);
+
+/**
+ * Writes all of the output left, for when writes wait for the terminal
+ * again.
+ */
+void screen_sync(void);
+
+/**
+ * Starts a new frame of the given number of lines and columns.
+ */
+void screen_begin(int num_lines, int cols);
+
+/**
+ * Scrolls the lines from top to bottom (both included) of the terminal up by
+ * the given number of lines, down if negative, as the first thing of the
+ * frame. The lines scrolled into view are left blank for the frame to draw.
+ */
+void screen_scroll(int top, int bottom, int by);
+
+/**
+ * Sets the line at the given index of the frame to what was drawn into line,
+ * which is left empty for the next line to be drawn into. The line only gets
+ * written to the terminal if it differs from the last one written there.
+ */
+void screen_line(int at, abuf *line);
+
+/**
+ * Writes the lines that changed and puts the cursor at row r and column c
+ * (both starting from 1), as much of it as the terminal takes right away.
+ */
+void screen_end(int r, int c);
+
+/**
+ * Forgets what the terminal shows, the next frame gets written in full.
+ */
+void screen_invalidate(void);
+
+typedef struct {
+    long frames;
+    // written to the terminal, in total and for the last frame
+    long bytes;
+    long frame_bytes;
+    // frames not drawn as the terminal was still taking in an earlier one
+    long skipped;
+} screen_stats;
+
+/**
+ * Returns how much was written to the terminal so far.
+ */
+screen_stats screen_get_stats(void);
+
+#endif // INCLUDE_SRC_SCREEN_H_
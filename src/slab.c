@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+#include "util.h"
+
+#define SLAB_MIN 16
+#define SLAB_CHUNK (64 * 1024)
+// keeps the blocks after a chunk's link suitably aligned
+#define SLAB_HEADER 16
+
+struct slab_big {
+    slab_big *prev;
+    slab_big *next;
+};
+
+static int size_class(size_t size)
+{
+    int c = 0;
+
+    while (((size_t)SLAB_MIN << c) < size) {
+        c++;
+    }
+
+    return c;
+}
+
+size_t slab_size(size_t size)
+{
+    int c = size_class(size);
+
+    return c < SLAB_CLASSES ? (size_t)SLAB_MIN << c : size;
+}
+
+/**
+ * Blocks too big for a size class get a header linking them to the others,
+ * so slab_release can find them.
+ */
+static void link_big(slab *s, slab_big *big)
+{
+    big->prev = NULL;
+    big->next = s->big;
+    if (s->big) {
+        s->big->prev = big;
+    }
+    s->big = big;
+}
+
+static void unlink_big(slab *s, slab_big *big)
+{
+    if (big->prev) {
+        big->prev->next = big->next;
+    } else {
+        s->big = big->next;
+    }
+    if (big->next) {
+        big->next->prev = big->prev;
+    }
+}
+
+void *slab_alloc(slab *s, size_t size)
+{
+    int c = size_class(size);
+
+    if (c >= SLAB_CLASSES) {
+        slab_big *big = malloc(SLAB_HEADER + size);
+
+        if (!big) {
+            DIE("Failed to allocate memory");
+        }
+
+        link_big(s, big);
+        s->heap_bytes += SLAB_HEADER + size;
+        s->heap_allocs++;
+
+        return (char *)big + SLAB_HEADER;
+    }
+
+    void *p = s->free[c];
+
+    if (p) {
+        memcpy(&s->free[c], p, sizeof(void *));
+        return p;
+    }
+
+    size = (size_t)SLAB_MIN << c;
+
+    if (s->end - s->next < (ptrdiff_t)size) {
+        // the rest of the current chunk is given up on, it is smaller than
+        // the biggest size class
+        char *chunk = malloc(SLAB_CHUNK);
+
+        if (!chunk) {
+            DIE("Failed to allocate memory");
+        }
+
+        memcpy(chunk, &s->chunks, sizeof(char *));
+        s->chunks = chunk;
+        s->next = chunk + SLAB_HEADER;
+        s->end = chunk + SLAB_CHUNK;
+        s->heap_bytes += SLAB_CHUNK;
+        s->heap_allocs++;
+    }
+
+    p = s->next;
+    s->next += size;
+
+    return p;
+}
+
+void slab_free(slab *s, void *p, size_t size)
+{
+    if (!p) {
+        return;
+    }
+
+    int c = size_class(size);
+
+    if (c >= SLAB_CLASSES) {
+        slab_big *big = (slab_big *)((char *)p - SLAB_HEADER);
+        unlink_big(s, big);
+        s->heap_bytes -= SLAB_HEADER + size;
+        s->heap_allocs--;
+        free(big);
+        return;
+    }
+
+    memcpy(p, &s->free[c], sizeof(void *));
+    s->free[c] = p;
+}
+
+void *slab_realloc(slab *s, void *p, size_t size, size_t new_size, size_t keep)
+{
+    if (p && size_class(size) >= SLAB_CLASSES &&
+        size_class(new_size) >= SLAB_CLASSES) {
+        slab_big *big = (slab_big *)((char *)p - SLAB_HEADER);
+        unlink_big(s, big);
+        big = realloc(big, SLAB_HEADER + new_size);
+
+        if (!big) {
+            DIE("Failed to allocate memory");
+        }
+
+        link_big(s, big);
+        s->heap_bytes += new_size - size;
+
+        return (char *)big + SLAB_HEADER;
+    }
+
+    void *new = slab_alloc(s, new_size);
+
+    if (p) {
+        memcpy(new, p, keep);
+        slab_free(s, p, size);
+    }
+
+    return new;
+}
+
+void slab_release(slab *s)
+{
+    while (s->chunks) {
+        char *chunk = s->chunks;
+        memcpy(&s->chunks, chunk, sizeof(char *));
+        free(chunk);
+    }
+
+    while (s->big) {
+        slab_big *big = s->big;
+        s->big = big->next;
+        free(big);
+    }
+
+    *s = (slab)SLAB_INIT;
+}
@@ -0,0 +1,53 @@
+#ifndef INCLUDE_SRC_SLAB_H_
+#define INCLUDE_SRC_SLAB_H_
+
+#include <stddef.h>
+
+// power of two size classes from 16 to 2048 bytes
+#define SLAB_CLASSES 8
+
+typedef struct slab_big slab_big;
+
+/**
+ * Allocator for row buffers: small blocks are carved out of large chunks and
+ * recycled through a free list per size class, bigger ones come from malloc.
+ * Everything it handed out is released at once with slab_release.
+ */
+typedef struct {
+    void *free[SLAB_CLASSES];
+    char *chunks; // chunks in use, linked through their first bytes
+    char *next;   // unused part of the newest chunk
+    char *end;
+    slab_big *big;
+    // heap usage
+    size_t heap_bytes;
+    size_t heap_allocs;
+} slab;
+
+#define SLAB_INIT {{NULL}, NULL, NULL, NULL, NULL, 0, 0}
+
+/**
+ * Returns the size of the block slab_alloc hands out for size bytes, which
+ * callers may use in full.
+ */
+size_t slab_size(size_t size);
+
+void *slab_alloc(slab *s, size_t size);
+
+/**
+ * Frees a block, size being the size it was allocated (or last resized) with.
+ */
+void slab_free(slab *s, void *p, size_t size);
+
+/**
+ * Resizes a block, keeping the first keep bytes of its content.
+ */
+void *slab_realloc(slab *s, void *p, size_t size, size_t new_size,
+                   size_t keep);
+
+/**
+ * Frees every block at once.
+ */
+void slab_release(slab *s);
+
+#endif // INCLUDE_SRC_SLAB_H_
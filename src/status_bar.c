@@ -7,6 +7,7 @@
 #include "append_buffer.h"
 #include "editor.h"
 #include "kbd.h"
+#include "loader.h"
 #include "status_bar.h"
 #include "util.h"
 
@@ -19,11 +20,35 @@ void draw_status_bar(abuf *buf)
 
     int len = snprintf(status, sizeof(status), "%s%s",
                        ec.filename ? ec.filename : "[No name]",
-                       ec.dirty ? "[+]" : "");
-    int cl_len =
-        snprintf(curr_line_status, sizeof(curr_line_status), "%s | %d:%d ",
-                 ec.syntax ? ec.syntax->file_type : "No file type", ec.cy + 1,
-                 ec.cx + 1);
+                       ec.read_only ? " [read only]"
+                       : ec.dirty   ? "[+]"
+                                    : "");
+    // snprintf returns the length it would have written, the buffers hold
+    // one less than their size at most
+    if (len > (int)sizeof(status) - 1) {
+        len = sizeof(status) - 1;
+    }
+
+    int cl_len = 0;
+    int progress = loader_progress();
+
+    if (progress >= 0) {
+        cl_len = snprintf(curr_line_status, sizeof(curr_line_status),
+                          "loading %d%% | ", progress);
+        if (cl_len > (int)sizeof(curr_line_status) - 1) {
+            cl_len = sizeof(curr_line_status) - 1;
+        }
+    }
+
+    cl_len += snprintf(&curr_line_status[cl_len],
+                       sizeof(curr_line_status) - cl_len, "%s | %d:%d @%ld ",
+                       ec.syntax ? ec.syntax->file_type : "No file type",
+                       ec.cy + 1, ec.cx + 1,
+                       doc_offset(&ec.doc, ec.cy) + ec.cx);
+    if (cl_len > (int)sizeof(curr_line_status) - 1) {
+        cl_len = sizeof(curr_line_status) - 1;
+    }
+
     if (len > ec.cols) {
         len = ec.cols;
     }
@@ -42,16 +67,10 @@ void draw_status_bar(abuf *buf)
 
     // switch back to normal formatting
     buf_append(buf, "\x1b[m", 3);
-
-    // another line for status message
-    buf_append(buf, "\r\n", 2);
 }
 
 void draw_message_bar(abuf *buf)
 {
-    // clear row
-    buf_append(buf, "\x1b[K", 3);
-
     int msg_len = strlen(ec.status_msg);
     if (msg_len > ec.cols) {
         msg_len = ec.cols;